@@ -0,0 +1,11 @@
+#!/bin/bash
+#SBATCH --time=00:15:00
+#SBATCH -N 16
+#SBATCH --ntasks-per-node=1
+#SBATCH --cpus-per-task=16
+
+export OMP_NUM_THREADS=$SLURM_CPUS_PER_TASK
+export OMP_PROC_BIND=close
+export OMP_PLACES=cores
+
+mpirun -np 16 --map-by ppr:1:node:PE=$OMP_NUM_THREADS cgc_mpi /var/scratch/bwn200/HPC_data/spring_data_m.npy /var/scratch/bwn200/HPC_data/spring_labels_m_5x100.txt --max-iterations 125 --output "hybrid.txt"
\ No newline at end of file
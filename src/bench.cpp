@@ -0,0 +1,546 @@
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <sstream>
+
+#include "common.h"
+#include "fused_kernels.h"
+#include "gemm_kernels.h"
+#include "serial_kernels.h"
+
+/**
+ * Microbenchmarks of the serial kernels and the I/O functions. Every kernel
+ * is run on synthetic data for a sweep of shapes, label counts and data
+ * types. For each run, the time per matrix element, the achieved bandwidth
+ * and the effective FLOP/s are reported. The bandwidth is computed from the
+ * compulsory traffic of a kernel (the matrix and the labels are each read
+ * once) and compared to the bandwidth of the STREAM triad measured at
+ * startup, so a kernel at 100% is bound by memory bandwidth.
+ */
+
+// Results of the kernels are accumulated here so they cannot be optimized away
+static volatile double bench_sink = 0;
+
+/**
+ * Returns the best time in seconds of `repetitions` calls to `fun`.
+ */
+template<typename F>
+static double time_best(int repetitions, F fun) {
+    double best = INFINITY;
+
+    for (int r = 0; r < repetitions; r++) {
+        auto before = std::chrono::high_resolution_clock::now();
+        fun();
+        auto after = std::chrono::high_resolution_clock::now();
+        best = std::min(best, std::chrono::duration<double>(after - before).count());
+    }
+
+    return best;
+}
+
+/**
+ * Measure the memory bandwidth in GB/s with the STREAM triad kernel
+ * (a[i] = b[i] + s * c[i]) on arrays of `n` doubles. The arrays should be
+ * much larger than the last-level cache.
+ */
+static double measure_stream_bandwidth(size_t n, int repetitions) {
+    auto a = std::vector<double>(n, 0.0);
+    auto b = std::vector<double>(n, 1.0);
+    auto c = std::vector<double>(n, 2.0);
+    double scalar = 3.0;
+
+    double seconds = time_best(repetitions, [&]() {
+        for (size_t i = 0; i < n; i++) {
+            a[i] = b[i] + scalar * c[i];
+        }
+
+        bench_sink = bench_sink + a[n / 2];
+    });
+
+    return 3.0 * n * sizeof(double) / seconds / 1e9;
+}
+
+static void print_table_header() {
+    printf(
+        "%-26s %-8s %-7s %16s %-8s %10s %9s %8s %9s\n",
+        "kernel",
+        "type",
+        "shape",
+        "size",
+        "labels",
+        "ns/elem",
+        "GB/s",
+        "%stream",
+        "GFLOP/s");
+}
+
+static void print_result(
+    const char* kernel,
+    const char* type,
+    const char* shape,
+    int num_rows,
+    int num_cols,
+    const std::string& labels,
+    double seconds,
+    double elements,
+    double bytes,
+    double flops,
+    double stream_bandwidth) {
+    auto size = std::to_string(num_rows) + "x" + std::to_string(num_cols);
+    double bandwidth = bytes / seconds / 1e9;
+
+    printf(
+        "%-26s %-8s %-7s %16s %-8s %10.3f %9.3f %7.1f%% %9.3f\n",
+        kernel,
+        type,
+        shape,
+        size.c_str(),
+        labels.c_str(),
+        seconds / elements * 1e9,
+        bandwidth,
+        100.0 * bandwidth / stream_bandwidth,
+        flops / seconds / 1e9);
+    fflush(stdout);
+}
+
+template<typename T>
+static void bench_kernels(
+    const char* type,
+    const char* shape,
+    int num_rows,
+    int num_cols,
+    int num_row_labels,
+    int num_col_labels,
+    int repetitions,
+    double stream_bandwidth,
+    std::mt19937& rng) {
+    auto normal = std::normal_distribution<typename compute_type<T>::type>(0, 1);
+    auto matrix = std::vector<T>(size_t(num_rows) * num_cols);
+
+    for (auto& item : matrix) {
+        item = T(normal(rng));
+    }
+
+    auto row_labels = initialize_labels(num_rows, num_row_labels, rng);
+    auto col_labels = initialize_labels(num_cols, num_col_labels, rng);
+    auto labels = std::to_string(num_row_labels) + "x" + std::to_string(num_col_labels);
+
+    double elements = double(num_rows) * num_cols;
+    double bytes = elements * sizeof(T) + double(num_rows + num_cols) * sizeof(label_type);
+    auto workspace = serial_workspace<T>(num_row_labels, num_col_labels);
+    const auto* cluster_avg = workspace.cluster_avg.data();
+
+    // One addition per element
+    double seconds = time_best(repetitions, [&]() {
+        calculate_cluster_average(
+            num_rows,
+            num_cols,
+            num_row_labels,
+            num_col_labels,
+            matrix.data(),
+            row_labels.data(),
+            col_labels.data(),
+            &workspace);
+        bench_sink = bench_sink + cluster_avg[0];
+    });
+    print_result(
+        "calculate_cluster_average",
+        type,
+        shape,
+        num_rows,
+        num_cols,
+        labels,
+        seconds,
+        elements,
+        bytes,
+        elements,
+        stream_bandwidth);
+
+    // A subtraction, multiplication and addition per element and label
+    seconds = time_best(repetitions, [&]() {
+        auto [num_updated, total_dist] = update_row_labels(
+            num_rows,
+            num_cols,
+            num_row_labels,
+            num_col_labels,
+            matrix.data(),
+            row_labels.data(),
+            col_labels.data(),
+            cluster_avg);
+        bench_sink = bench_sink + num_updated + total_dist;
+    });
+    print_result(
+        "update_row_labels",
+        type,
+        shape,
+        num_rows,
+        num_cols,
+        labels,
+        seconds,
+        elements,
+        bytes,
+        3.0 * elements * num_row_labels,
+        stream_bandwidth);
+
+    seconds = time_best(repetitions, [&]() {
+        auto [num_updated, total_dist] = update_col_labels(
+            num_rows,
+            num_cols,
+            num_col_labels,
+            matrix.data(),
+            row_labels.data(),
+            col_labels.data(),
+            cluster_avg);
+        bench_sink = bench_sink + num_updated + total_dist;
+    });
+    print_result(
+        "update_col_labels",
+        type,
+        shape,
+        num_rows,
+        num_cols,
+        labels,
+        seconds,
+        elements,
+        bytes,
+        3.0 * elements * num_col_labels,
+        stream_bandwidth);
+
+    // A multiplication and addition per element and label
+    gemm_workspace gemm;
+    resize_gemm_workspace(num_row_labels, num_col_labels, &gemm);
+
+    seconds = time_best(repetitions, [&]() {
+        auto [num_updated, total_dist] = update_row_labels_gemm(
+            num_rows,
+            num_cols,
+            num_row_labels,
+            num_col_labels,
+            matrix.data(),
+            row_labels.data(),
+            col_labels.data(),
+            cluster_avg,
+            &gemm);
+        bench_sink = bench_sink + num_updated + total_dist;
+    });
+    print_result(
+        "update_row_labels_gemm",
+        type,
+        shape,
+        num_rows,
+        num_cols,
+        labels,
+        seconds,
+        elements,
+        bytes,
+        2.0 * elements * num_row_labels,
+        stream_bandwidth);
+
+    seconds = time_best(repetitions, [&]() {
+        auto [num_updated, total_dist] = update_col_labels_gemm(
+            num_rows,
+            num_cols,
+            num_row_labels,
+            num_col_labels,
+            matrix.data(),
+            row_labels.data(),
+            col_labels.data(),
+            cluster_avg,
+            &gemm);
+        bench_sink = bench_sink + num_updated + total_dist;
+    });
+    print_result(
+        "update_col_labels_gemm",
+        type,
+        shape,
+        num_rows,
+        num_cols,
+        labels,
+        seconds,
+        elements,
+        bytes,
+        2.0 * elements * num_col_labels,
+        stream_bandwidth);
+
+    // The single pass of the fused iteration: an addition for the row sum, a
+    // multiplication and addition for the row norm, and the same three for
+    // the column sums per element
+    fused_workspace fused;
+    resize_fused_workspace(num_cols, num_row_labels, num_col_labels, &fused);
+
+    seconds = time_best(repetitions, [&]() {
+        auto [num_updated, total_dist] = update_fused_row_labels(
+            num_rows,
+            num_cols,
+            num_row_labels,
+            num_col_labels,
+            matrix.data(),
+            row_labels.data(),
+            col_labels.data(),
+            cluster_avg,
+            &fused);
+        bench_sink = bench_sink + num_updated + total_dist;
+    });
+    print_result(
+        "update_fused_row_labels",
+        type,
+        shape,
+        num_rows,
+        num_cols,
+        labels,
+        seconds,
+        elements,
+        bytes,
+        6.0 * elements,
+        stream_bandwidth);
+}
+
+/**
+ * Benchmark the label and matrix I/O of common.h on files in `directory`.
+ * Note that the files are read back from the page cache, so the results are
+ * an upper bound of what can be achieved on a cold file system.
+ */
+static bool bench_io(
+    const std::string& directory,
+    const char* shape,
+    int num_rows,
+    int num_cols,
+    int repetitions,
+    double stream_bandwidth,
+    std::mt19937& rng) {
+    auto row_labels = initialize_labels(num_rows, std::min(num_rows, 20), rng);
+    auto col_labels = initialize_labels(num_cols, std::min(num_cols, 20), rng);
+    double num_labels = double(num_rows) + num_cols;
+    bool ok = true;
+
+    for (std::string extension : {".txt", ".bin"}) {
+        auto file_name = directory + "/cgc_bench_labels" + extension;
+        auto kernel = "write_labels(" + extension + ")";
+
+        double seconds = time_best(repetitions, [&]() {
+            write_labels(file_name, num_rows, num_cols, row_labels.data(), col_labels.data());
+        });
+
+        auto file_size = std::ifstream(file_name, std::ifstream::ate | std::ifstream::binary).tellg();
+        print_result(
+            kernel.c_str(),
+            "label",
+            shape,
+            num_rows,
+            num_cols,
+            "-",
+            seconds,
+            num_labels,
+            double(file_size),
+            0,
+            stream_bandwidth);
+
+        // read_labels only supports the text format
+        if (extension == ".txt") {
+            seconds = time_best(repetitions, [&]() {
+                ok = ok
+                    && read_labels(
+                        file_name,
+                        num_rows,
+                        num_cols,
+                        row_labels.data(),
+                        col_labels.data());
+            });
+            print_result(
+                "read_labels(.txt)",
+                "label",
+                shape,
+                num_rows,
+                num_cols,
+                "-",
+                seconds,
+                num_labels,
+                double(file_size),
+                0,
+                stream_bandwidth);
+        }
+
+        std::remove(file_name.c_str());
+    }
+
+    auto file_name = directory + "/cgc_bench_matrix.npy";
+    auto matrix = std::vector<float>(size_t(num_rows) * num_cols, 1.0f);
+    npy::SaveArrayAsNumpy(
+        file_name,
+        false,
+        2,
+        std::vector<unsigned long> {(unsigned long)num_rows, (unsigned long)num_cols}.data(),
+        matrix);
+
+    double seconds = time_best(repetitions, [&]() {
+        std::vector<unsigned long> shape_read;
+        size_t data_offset;
+        read_matrix_header(file_name, &shape_read, &data_offset);
+        ok = ok && read_matrix_data(file_name, data_offset, matrix.size(), matrix.data());
+    });
+    print_result(
+        "read_matrix",
+        "float",
+        shape,
+        num_rows,
+        num_cols,
+        "-",
+        seconds,
+        double(matrix.size()),
+        double(matrix.size()) * sizeof(float),
+        0,
+        stream_bandwidth);
+
+    std::remove(file_name.c_str());
+    return ok;
+}
+
+int main(int argc, const char* argv[]) {
+    auto program = argparse::ArgumentParser(argv[0]);
+    program.add_argument("--elements", "-n")
+        .scan<'i', int>()
+        .help("Number of matrix elements of each shape")
+        .default_value(1 << 22);
+
+    program.add_argument("--labels")
+        .help("Comma-separated list of label counts, e.g. 2x2,5x20")
+        .default_value(std::string("2x2,5x20,20x50"));
+
+    program.add_argument("--types")
+        .help("Comma-separated list of data types (float, double, bfloat16)")
+        .default_value(std::string("float,double"));
+
+    program.add_argument("--repetitions", "-r")
+        .scan<'i', int>()
+        .help("Number of repetitions of each benchmark; the best time is reported")
+        .default_value(3);
+
+    program.add_argument("--stream-elements")
+        .scan<'i', int>()
+        .help("Number of doubles per array of the STREAM triad")
+        .default_value(1 << 24);
+
+    program.add_argument("--io-dir")
+        .help("Directory for the files of the I/O benchmarks")
+        .default_value(std::string("/tmp"));
+
+    program.add_argument("--no-io")
+        .help("Skip the I/O benchmarks")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("--seed", "-s")
+        .scan<'i', int>()
+        .help("Random seed used for the synthetic data")
+        .default_value(1);
+
+    std::vector<std::pair<int, int>> label_configs;
+
+    try {
+        program.parse_args(argc, argv);
+    } catch (const std::runtime_error& err) {
+        fprintf(stderr, "error: %s\n", err.what());
+        return EXIT_FAILURE;
+    }
+
+    int num_elements = program.get<int>("--elements");
+    int repetitions = program.get<int>("--repetitions");
+
+    if (num_elements < 64 * 64 || repetitions <= 0
+        || !parse_label_configs(program.get("--labels"), &label_configs)) {
+        fprintf(stderr, "error: invalid benchmark configuration\n");
+        return EXIT_FAILURE;
+    }
+
+    // Tall and wide shapes have 64 columns or rows, respectively
+    int side = int(std::sqrt(double(num_elements)));
+    std::vector<std::tuple<const char*, int, int>> shapes = {
+        {"tall", num_elements / 64, 64},
+        {"square", side, side},
+        {"wide", 64, num_elements / 64},
+    };
+
+    std::vector<std::string> types;
+    auto stream = std::stringstream(program.get("--types"));
+    std::string type;
+
+    while (std::getline(stream, type, ',')) {
+        if (type != "float" && type != "double" && type != "bfloat16") {
+            fprintf(stderr, "error: unsupported data type: %s\n", type.c_str());
+            return EXIT_FAILURE;
+        }
+
+        types.push_back(type);
+    }
+
+    double stream_bandwidth =
+        measure_stream_bandwidth(program.get<int>("--stream-elements"), repetitions);
+    std::cout << "STREAM triad bandwidth: " << stream_bandwidth << " GB/s\n";
+
+    auto rng = std::mt19937(program.get<int>("--seed"));
+    print_table_header();
+
+    for (const auto& [shape, num_rows, num_cols] : shapes) {
+        for (const auto& [num_row_labels, num_col_labels] : label_configs) {
+            if (num_row_labels > num_rows || num_col_labels > num_cols) {
+                continue;
+            }
+
+            for (const auto& type : types) {
+                if (type == "float") {
+                    bench_kernels<float>(
+                        "float",
+                        shape,
+                        num_rows,
+                        num_cols,
+                        num_row_labels,
+                        num_col_labels,
+                        repetitions,
+                        stream_bandwidth,
+                        rng);
+                } else if (type == "bfloat16") {
+                    bench_kernels<bfloat16>(
+                        "bfloat16",
+                        shape,
+                        num_rows,
+                        num_cols,
+                        num_row_labels,
+                        num_col_labels,
+                        repetitions,
+                        stream_bandwidth,
+                        rng);
+                } else {
+                    bench_kernels<double>(
+                        "double",
+                        shape,
+                        num_rows,
+                        num_cols,
+                        num_row_labels,
+                        num_col_labels,
+                        repetitions,
+                        stream_bandwidth,
+                        rng);
+                }
+            }
+        }
+    }
+
+    if (!program.get<bool>("--no-io")) {
+        for (const auto& [shape, num_rows, num_cols] : shapes) {
+            if (!bench_io(
+                    program.get("--io-dir"),
+                    shape,
+                    num_rows,
+                    num_cols,
+                    repetitions,
+                    stream_bandwidth,
+                    rng)) {
+                return EXIT_FAILURE;
+            }
+        }
+    }
+
+    std::cout << "checksum: " << bench_sink << "\n";
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,264 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+
+#include "common.h"
+#include "memory.h"
+#include "serial_kernels.h"
+
+/*
+ * Label updates restricted to candidate labels (`cgc_serial --candidates`).
+ * After a few iterations, a row or column only moves between a few nearby
+ * labels. A full sweep evaluates all labels with `update_row_labels` and
+ * `update_col_labels`, which also store the `num_candidates` closest labels
+ * of every row and column. The iterations in between only evaluate those
+ * candidates, which cuts the work per item from all labels to
+ * `num_candidates`.
+ *
+ * The current label of an item is always one of its candidates: it was the
+ * closest label of the last full sweep, and the restricted updates only pick
+ * candidates. The distances are summed in the same order as by the full
+ * kernels, and ties are resolved in the same way, so a restricted update
+ * gives the same labels as a full one whenever the best label is a
+ * candidate.
+ */
+
+static const int max_candidates = 32;
+static const double candidate_stall_tolerance = 1e-4;
+
+/**
+ * The candidate labels of the rows and columns, of size
+ * (num_rows, num_row_candidates) and (num_cols, num_col_candidates), and the
+ * state that decides when to perform a full sweep, see
+ * `begin_candidate_iteration`.
+ */
+struct candidate_workspace {
+    tracked_vector<label_type, MEMORY_LABELS> row_candidates;
+    tracked_vector<label_type, MEMORY_LABELS> col_candidates;
+    tracked_vector<double, MEMORY_DISTANCES> row_candidate_dist;
+    tracked_vector<double, MEMORY_DISTANCES> col_candidate_dist;
+    int num_row_candidates = 0;
+    int num_col_candidates = 0;
+    int sweep_interval = 1;
+    int iterations_since_sweep = 0;
+    bool full_sweep = true;
+    bool stalled = false;
+    double objective = INFINITY;
+};
+
+/**
+ * Returns the size of the buffers allocated by `resize_candidate_workspace`.
+ */
+static inline double estimate_candidate_workspace_bytes(
+    int num_rows,
+    int num_cols,
+    int num_row_labels,
+    int num_col_labels,
+    int num_candidates) {
+    double num_items = double(num_rows) * std::min(num_candidates, num_row_labels)
+        + double(num_cols) * std::min(num_candidates, num_col_labels);
+    return num_items * (sizeof(label_type) + sizeof(double));
+}
+
+/**
+ * Allocate the candidate lists of `num_candidates` labels per item (at most
+ * the number of labels), with a full sweep at least every `sweep_interval`
+ * iterations. The first iteration is a full sweep.
+ */
+
+static inline void resize_candidate_workspace(
+    int num_rows,
+    int num_cols,
+    int num_row_labels,
+    int num_col_labels,
+    int num_candidates,
+    int sweep_interval,
+    candidate_workspace* candidates) {
+    candidates->num_row_candidates = std::min(num_candidates, num_row_labels);
+    candidates->num_col_candidates = std::min(num_candidates, num_col_labels);
+    candidates->row_candidates.resize(size_t(num_rows) * candidates->num_row_candidates);
+    candidates->col_candidates.resize(size_t(num_cols) * candidates->num_col_candidates);
+    candidates->row_candidate_dist.resize(size_t(num_rows) * candidates->num_row_candidates);
+    candidates->col_candidate_dist.resize(size_t(num_cols) * candidates->num_col_candidates);
+    candidates->sweep_interval = sweep_interval;
+    candidates->iterations_since_sweep = 0;
+    candidates->full_sweep = true;
+    candidates->stalled = false;
+    candidates->objective = INFINITY;
+}
+
+/**
+ * Decide whether the next iteration is a full sweep, and store it in
+ * `candidates->full_sweep`. This is the case for the first iteration, every
+ * `sweep_interval` iterations, and after an iteration in which the objective
+ * stalled (see `end_candidate_iteration`).
+ */
+static inline void begin_candidate_iteration(candidate_workspace* candidates) {
+    candidates->full_sweep = candidates->objective == INFINITY
+        || candidates->stalled
+        || candidates->iterations_since_sweep + 1 >= candidates->sweep_interval;
+}
+
+/**
+ * Record the outcome of an iteration. A restricted iteration stalls if it
+ * updates no labels or decreases the objective by less than
+ * `candidate_stall_tolerance` relative to the previous one: the candidates
+ * might have gone stale, so a full sweep follows.
+ */
+static inline void end_candidate_iteration(
+    int num_updated,
+    double objective,
+    candidate_workspace* candidates) {
+    if (candidates->full_sweep) {
+        candidates->iterations_since_sweep = 0;
+        candidates->stalled = false;
+    } else {
+        candidates->iterations_since_sweep++;
+        candidates->stalled = num_updated == 0
+            || !(candidates->objective - objective > candidate_stall_tolerance * candidates->objective);
+    }
+
+    candidates->objective = objective;
+}
+
+/**
+ * Like `update_row_labels`, but only evaluating the `num_candidates` labels
+ * of every row in `candidates`. Every row is read once, and the distances to
+ * all its candidates are summed together.
+ */
+template<typename T>
+static std::pair<int, double> update_row_labels_restricted(
+    int num_rows,
+    int num_cols,
+    int num_col_labels,
+    const T* matrix,
+    label_type* row_labels,
+    const label_type* col_labels,
+    const typename compute_type<T>::type* cluster_avg,
+    const label_type* candidates,
+    int num_candidates) {
+    using C = typename compute_type<T>::type;
+    const C* avg[max_candidates];
+    double dist[max_candidates];
+    int num_updated = 0;
+    double total_dist = 0;
+
+    for (int i = 0; i < num_rows; i++) {
+        const T* row = &matrix[index_type(i) * num_cols];
+        const label_type* labels = &candidates[index_type(i) * num_candidates];
+
+        // Unused candidates (-1) point at label 0 and are skipped below
+        for (int c = 0; c < num_candidates; c++) {
+            avg[c] = &cluster_avg[std::max(labels[c], 0) * num_col_labels];
+            dist[c] = 0;
+        }
+
+        for (int j = 0; j < num_cols; j++) {
+            C item = row[j];
+            int col_label = col_labels[j];
+
+            for (int c = 0; c < num_candidates; c++) {
+                dist[c] += calculate_distance(avg[c][col_label], item);
+            }
+        }
+
+        int best_label = -1;
+        double best_dist = INFINITY;
+
+        // On a tie, the lowest label wins, as in `update_row_labels`
+        for (int c = 0; c < num_candidates; c++) {
+            if (labels[c] >= 0
+                && (dist[c] < best_dist || (dist[c] == best_dist && labels[c] < best_label))) {
+                best_dist = dist[c];
+                best_label = labels[c];
+            }
+        }
+
+        if (row_labels[i] != best_label) {
+            row_labels[i] = best_label;
+            num_updated++;
+        }
+
+        total_dist += best_dist;
+    }
+
+    return {num_updated, total_dist};
+}
+
+/**
+ * Like `update_col_labels`, but only evaluating the `num_candidates` labels
+ * of every column in `candidates`. The matrix is read by row in blocks of
+ * columns, like by `update_col_labels`.
+ */
+template<typename T>
+static std::pair<int, double> update_col_labels_restricted(
+    int num_rows,
+    int num_cols,
+    int num_col_labels,
+    const T* matrix,
+    const label_type* row_labels,
+    label_type* col_labels,
+    const typename compute_type<T>::type* cluster_avg,
+    const label_type* candidates,
+    int num_candidates) {
+    using C = typename compute_type<T>::type;
+    const int block_cols = 128;
+    label_type labels[block_cols * max_candidates];
+    double dist[block_cols * max_candidates];
+    int num_updated = 0;
+    double total_dist = 0;
+
+    for (int col_begin = 0; col_begin < num_cols; col_begin += block_cols) {
+        int num_block_cols = std::min(block_cols, num_cols - col_begin);
+        int num_block_candidates = num_block_cols * num_candidates;
+        const label_type* block_candidates = &candidates[index_type(col_begin) * num_candidates];
+
+        // Unused candidates (-1) read label 0 and are skipped below
+        for (int n = 0; n < num_block_candidates; n++) {
+            labels[n] = std::max(block_candidates[n], 0);
+        }
+
+        std::fill(dist, dist + num_block_candidates, 0.0);
+
+        for (int i = 0; i < num_rows; i++) {
+            const T* row = &matrix[index_type(i) * num_cols + col_begin];
+            const C* avg = &cluster_avg[row_labels[i] * num_col_labels];
+
+            for (int j = 0; j < num_block_cols; j++) {
+                C item = row[j];
+
+                for (int c = 0; c < num_candidates; c++) {
+                    int n = j * num_candidates + c;
+                    dist[n] += calculate_distance(avg[labels[n]], item);
+                }
+            }
+        }
+
+        for (int j = 0; j < num_block_cols; j++) {
+            int best_label = -1;
+            double best_dist = INFINITY;
+
+            // On a tie, the lowest label wins, as in `update_col_labels`
+            for (int c = 0; c < num_candidates; c++) {
+                int n = j * num_candidates + c;
+                int label = block_candidates[n];
+
+                if (label >= 0 && (dist[n] < best_dist || (dist[n] == best_dist && label < best_label))) {
+                    best_dist = dist[n];
+                    best_label = label;
+                }
+            }
+
+            if (col_labels[col_begin + j] != best_label) {
+                col_labels[col_begin + j] = best_label;
+                num_updated++;
+            }
+
+            total_dist += best_dist;
+        }
+    }
+
+    return {num_updated, total_dist};
+}
@@ -1,9 +1,13 @@
 #pragma once
 
 #include <algorithm>
+#include <climits>
+#include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <random>
 #include <regex>
+#include <sstream>
 #include <unordered_set>
 
 #include "argparse/argparse.hpp"
@@ -11,7 +15,56 @@
 
 using label_type = int;
 
-static bool read_labels(
+/**
+ * The type of element offsets in a matrix and of element counts. Every
+ * dimension of a matrix fits in an int, but the number of elements can exceed
+ * 2^31, so `i * num_cols + j` must be computed as `index_type(i) * num_cols + j`.
+ */
+using index_type = int64_t;
+
+/**
+ * A matrix value stored in 16 bits: the upper half of a float32, rounded to
+ * the nearest even value. Used by the reduced-precision strategy (see
+ * memory.h) to halve the size of the matrix; all arithmetic is done in float.
+ */
+struct bfloat16 {
+    uint16_t bits;
+
+    bfloat16() = default;
+
+    explicit bfloat16(float value) {
+        uint32_t x;
+        memcpy(&x, &value, sizeof(x));
+
+        if ((x & 0x7fffffff) > 0x7f800000) {
+            bits = uint16_t((x >> 16) | 0x40);  // keep NaN a (quiet) NaN
+        } else {
+            bits = uint16_t((x + 0x7fff + ((x >> 16) & 1)) >> 16);
+        }
+    }
+
+    operator float() const {
+        uint32_t x = uint32_t(bits) << 16;
+        float value;
+        memcpy(&value, &x, sizeof(value));
+        return value;
+    }
+};
+
+/**
+ * The type in which the kernels compute with matrix values of type T.
+ */
+template<typename T>
+struct compute_type {
+    using type = T;
+};
+
+template<>
+struct compute_type<bfloat16> {
+    using type = float;
+};
+
+static inline bool read_labels(
     const std::string& file_name,
     int num_rows,
     int num_cols,
@@ -69,13 +122,33 @@ static bool read_labels(
     return true;
 }
 
-static void write_labels(
+/**
+ * Label files ending in ".bin" are stored in binary: the number of rows and
+ * columns followed by the row labels and the column labels, all as 32-bit
+ * integers. Other label files are text with one label per line.
+ */
+static inline bool is_binary_label_file(const std::string& file_name) {
+    return file_name.size() >= 4
+        && file_name.compare(file_name.size() - 4, 4, ".bin") == 0;
+}
+
+static inline void write_labels(
     const std::string& file_name,
     int num_rows,
     int num_cols,
     const label_type* row_labels,
     const label_type* col_labels) {
     fprintf(stderr, "writing result to %s\n", file_name.c_str());
+
+    if (is_binary_label_file(file_name)) {
+        auto out = std::ofstream {file_name, std::ofstream::binary};
+        int header[2] = {num_rows, num_cols};
+        out.write(reinterpret_cast<const char*>(header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(row_labels), num_rows * sizeof(label_type));
+        out.write(reinterpret_cast<const char*>(col_labels), num_cols * sizeof(label_type));
+        return;
+    }
+
     auto out = std::ofstream {file_name};
 
     for (int i = 0; i < num_rows; i++) {
@@ -91,6 +164,83 @@ static void write_labels(
     out << "\n";
 }
 
+/**
+ * Read the header of the NPY file `file_name`. This returns the shape of the
+ * array and the offset in bytes at which its data starts, without reading the
+ * data itself. Throws an exception if the file is not a float32 NPY file.
+ */
+static inline void read_matrix_header(
+    const std::string& file_name,
+    std::vector<unsigned long>* shape_out,
+    size_t* data_offset_out) {
+    std::ifstream stream(file_name, std::ifstream::binary);
+    if (!stream) {
+        throw std::runtime_error("io error: failed to open a file.");
+    }
+
+    auto header = npy::parse_header(npy::read_header(stream));
+    auto dtype = npy::dtype_map.at(std::type_index(typeid(float)));
+
+    if (header.dtype.tie() != dtype.tie()) {
+        throw std::runtime_error("formatting error: typestrings not matching");
+    }
+
+    if (header.fortran_order) {
+        throw std::runtime_error("formatting error: fortran order not supported");
+    }
+
+    *shape_out = header.shape;
+    *data_offset_out = size_t(stream.tellg());
+}
+
+/**
+ * Read `count` floats starting at byte `offset` of the file `file_name`
+ * into `matrix`.
+ */
+static inline bool read_matrix_data(
+    const std::string& file_name,
+    size_t offset,
+    size_t count,
+    float* matrix) {
+    std::ifstream stream(file_name, std::ifstream::binary);
+    stream.seekg(offset);
+    stream.read(reinterpret_cast<char*>(matrix), count * sizeof(float));
+
+    if (!stream) {
+        fprintf(
+            stderr,
+            "error: error occurred while reading file: %s\n",
+            file_name.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Parse a comma-separated list of label counts, such as "5x100,10x20", into
+ * pairs of (number of row labels, number of column labels).
+ */
+static inline bool parse_label_configs(
+    const std::string& text,
+    std::vector<std::pair<int, int>>* configs) {
+    auto pattern = std::regex("([0-9]+)x([0-9]+)");
+    auto stream = std::stringstream(text);
+    std::string item;
+    std::smatch match;
+
+    while (std::getline(stream, item, ',')) {
+        if (!std::regex_match(item, match, pattern)) {
+            fprintf(stderr, "error: invalid label configuration: %s\n", item.c_str());
+            return false;
+        }
+
+        configs->emplace_back(std::stoi(match[1]), std::stoi(match[2]));
+    }
+
+    return true;
+}
+
 template<typename R>
 static std::vector<label_type>
 initialize_labels(int num_items, int num_labels, R& rng) {
@@ -104,19 +254,13 @@ initialize_labels(int num_items, int num_labels, R& rng) {
     return labels;
 }
 
-static bool parse_arguments(
-    int argc,
-    const char* argv[],
-    int* num_rows_out,
-    int* num_cols_out,
-    int* num_row_labels_out,
-    int* num_col_labels_out,
-    std::vector<float>* matrix_out,
-    std::vector<label_type>* row_labels_out,
-    std::vector<label_type>* col_labels_out,
-    std::string* result_file_out,
-    int* max_iter_out) {
-    auto program = argparse::ArgumentParser(argv[0]);
+/**
+ * Create the argument parser for the arguments shared by all implementations.
+ * An implementation can add its own arguments to the returned parser before
+ * passing it to `parse_arguments`.
+ */
+static inline argparse::ArgumentParser create_argument_parser(const char* program_name) {
+    auto program = argparse::ArgumentParser(program_name);
     program.add_argument("input-data")
         .help("Path to input data file in NPY format");
 
@@ -137,6 +281,41 @@ static bool parse_arguments(
         .help("Maximum number of iterations")
         .default_value(100);
 
+    program.add_argument("--metrics")
+        .help("Path to a JSON Lines file to write the metrics of every iteration to")
+        .default_value(std::string(""));
+
+    program.add_argument("--counters")
+        .help("Collect hardware performance counters per phase (Linux perf_event_open)")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("--memory-limit")
+        .help("Memory available for the run (e.g., 512M or 16G, per node for MPI); "
+              "selects an in-memory, reduced-precision or out-of-core matrix")
+        .default_value(std::string(""));
+
+    program.add_argument("--trace")
+        .help("Path to a Chrome trace-event file to write a timeline of the run to")
+        .default_value(std::string(""));
+
+    return program;
+}
+
+static inline bool parse_arguments(
+    argparse::ArgumentParser& program,
+    int argc,
+    const char* argv[],
+    int* num_rows_out,
+    int* num_cols_out,
+    int* num_row_labels_out,
+    int* num_col_labels_out,
+    std::vector<float>* matrix_out,
+    std::vector<label_type>* row_labels_out,
+    std::vector<label_type>* col_labels_out,
+    std::string* result_file_out,
+    int* max_iter_out,
+    std::string* input_file_out = nullptr) {
     try {
         program.parse_args(argc, argv);
     } catch (const std::runtime_error& err) {
@@ -149,7 +328,14 @@ static bool parse_arguments(
     std::vector<float> matrix;
 
     try {
-        npy::LoadArrayFromNumpy(input_file, shape, matrix);
+        if (input_file_out == nullptr) {
+            npy::LoadArrayFromNumpy(input_file, shape, matrix);
+        } else {
+            // The caller loads the data itself (e.g., into shared memory)
+            *input_file_out = input_file;
+            size_t data_offset;
+            read_matrix_header(input_file, &shape, &data_offset);
+        }
     } catch (const std::exception& e) {
         fprintf(
             stderr,
@@ -167,6 +353,19 @@ static bool parse_arguments(
         return false;
     }
 
+    // The labels of a row or column are indexed by int, and so are the
+    // label counts in MPI transfers
+    if (shape[0] > unsigned(INT_MAX) || shape[1] > unsigned(INT_MAX)) {
+        fprintf(
+            stderr,
+            "error: dimensions of %s exceed %d: %lu x %lu\n",
+            input_file.c_str(),
+            INT_MAX,
+            shape[0],
+            shape[1]);
+        return false;
+    }
+
     int num_rows = int(shape[0]);
     int num_cols = int(shape[1]);
 
@@ -224,10 +423,41 @@ static bool parse_arguments(
     *num_cols_out = num_cols;
     *num_row_labels_out = num_row_labels;
     *num_col_labels_out = num_col_labels;
-    *row_labels_out = row_labels;
-    *col_labels_out = col_labels;
+    *row_labels_out = std::move(row_labels);
+    *col_labels_out = std::move(col_labels);
     *matrix_out = std::move(matrix);
     *result_file_out = file_out;
     *max_iter_out = max_iter;
     return true;
 }
+
+static inline bool parse_arguments(
+    int argc,
+    const char* argv[],
+    int* num_rows_out,
+    int* num_cols_out,
+    int* num_row_labels_out,
+    int* num_col_labels_out,
+    std::vector<float>* matrix_out,
+    std::vector<label_type>* row_labels_out,
+    std::vector<label_type>* col_labels_out,
+    std::string* result_file_out,
+    int* max_iter_out,
+    std::string* input_file_out = nullptr) {
+    auto program = create_argument_parser(argv[0]);
+
+    return parse_arguments(
+        program,
+        argc,
+        argv,
+        num_rows_out,
+        num_cols_out,
+        num_row_labels_out,
+        num_col_labels_out,
+        matrix_out,
+        row_labels_out,
+        col_labels_out,
+        result_file_out,
+        max_iter_out,
+        input_file_out);
+}
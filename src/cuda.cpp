@@ -3,6 +3,10 @@
 #include <mpi.h>
 
 #include "common.h"
+#include "memory.h"
+#include "metrics.h"
+#include "mpi_profile.h"
+#include "timing.h"
 #include "cuda/module.h"
 
 std::pair<std::vector<int>, std::vector<int>> calculate_scatter(int n, int size) {
@@ -26,12 +30,43 @@ std::pair<std::vector<int>, std::vector<int>> calculate_scatter(int n, int size)
 }
 
 /**
- * This function returns a matrix of size (num_row_labels, num_col_labels)
+ * The host buffers of an iteration. They are allocated once per run, so that
+ * the iterations themselves do not allocate memory on the host.
+ */
+struct iteration_workspace {
+    tracked_vector<double, MEMORY_CLUSTERS> local_cluster_sum;
+    tracked_vector<index_type, MEMORY_CLUSTERS> local_cluster_size;
+    tracked_vector<double, MEMORY_CLUSTERS> cluster_sum;
+    tracked_vector<index_type, MEMORY_CLUSTERS> cluster_size;
+    tracked_vector<float, MEMORY_CLUSTERS> cluster_avg;
+    tracked_vector<int, MEMORY_BUFFERS> cluster_ids;
+    tracked_vector<label_type, MEMORY_LABELS> scatter_row_labels;
+    tracked_vector<label_type, MEMORY_LABELS> scatter_col_labels;
+
+    iteration_workspace(
+        int num_row_labels,
+        int num_col_labels,
+        int num_cols,
+        int num_rows_recv,
+        int num_cols_recv) :
+        local_cluster_sum(num_row_labels * num_col_labels),
+        local_cluster_size(num_row_labels * num_col_labels),
+        cluster_sum(num_row_labels * num_col_labels),
+        cluster_size(num_row_labels * num_col_labels),
+        cluster_avg(num_row_labels * num_col_labels),
+        cluster_ids(size_t(num_rows_recv) * num_cols),
+        scatter_row_labels(num_rows_recv),
+        scatter_col_labels(num_cols_recv) {}
+};
+
+/**
+ * This function calculates a matrix of size (num_row_labels, num_col_labels)
  * that stores the average value for each combination of row label and
  * column label. In other words, the entry at coordinate (x, y) is the
  * average over all input values having row label x and column label y.
+ * The result is stored in `workspace->cluster_avg`.
  */
-std::vector<float> calculate_cluster_average(
+void calculate_cluster_average(
     int num_rows,
     int num_cols,
     int num_row_labels,
@@ -40,14 +75,17 @@ std::vector<float> calculate_cluster_average(
     const int* row_labels,
     const int* col_labels,
     int row_displacement,
-    int num_rows_recv) {
-
-    int num_clusters = num_row_labels * num_col_labels;
-    auto local_cluster_sum =
-        std::vector<double>(num_clusters, 0.0);
-    auto local_cluster_size = std::vector<int>(num_clusters, 0);
-
-    auto cluster_ids = std::vector<int>(num_rows_recv*num_cols);
+    int num_rows_recv,
+    iteration_workspace* workspace) {
+    auto& local_cluster_sum = workspace->local_cluster_sum;
+    auto& local_cluster_size = workspace->local_cluster_size;
+    auto& cluster_ids = workspace->cluster_ids;
+    auto& cluster_sum = workspace->cluster_sum;
+    auto& cluster_size = workspace->cluster_size;
+    auto& cluster_avg = workspace->cluster_avg;
+
+    std::fill(local_cluster_sum.begin(), local_cluster_sum.end(), 0.0);
+    std::fill(local_cluster_size.begin(), local_cluster_size.end(), 0);
 
     call_cluster_id_kernel(
         num_rows,
@@ -61,18 +99,14 @@ std::vector<float> calculate_cluster_average(
 
     for (int i = 0; i < num_rows_recv; i++) {
         for (int j = 0; j < num_cols; j++) {
-            auto item = matrix[(i + row_displacement) * num_cols + j];
-            int c = cluster_ids[i * num_cols + j];
+            auto item = matrix[index_type(i + row_displacement) * num_cols + j];
+            int c = cluster_ids[index_type(i) * num_cols + j];
             
             local_cluster_sum[c] += item;
             local_cluster_size[c] += 1;
         }
     }
 
-    auto cluster_sum =
-        std::vector<double>(num_clusters, 0.0);
-    auto cluster_size = std::vector<int>(num_clusters, 0);
-
     for (int i = 0; i < cluster_sum.size(); i++) {
         MPI_Allreduce(
             local_cluster_sum.data(),
@@ -85,28 +119,26 @@ std::vector<float> calculate_cluster_average(
             local_cluster_size.data(),
             cluster_size.data(),
             cluster_size.size(),
-            MPI_INT,
+            MPI_INT64_T,
             MPI_SUM,
             MPI_COMM_WORLD);
     }
 
-    auto cluster_avg = std::vector<float>(num_clusters);
-
     call_cluster_average_kernel(
         num_row_labels,
         num_col_labels,
         cluster_sum.data(),
         cluster_size.data(),
         cluster_avg.data());
-
-    return cluster_avg;
 }
 
 /**
  * Perform one iteration of the co-clustering algorithm. This function updates
  * the labels in both `row_labels` and `col_labels`, and returns the total
  * number of labels that changed (i.e., the number of rows and columns that
- * were reassigned to a different label).
+ * were reassigned to a different label). The number of updates per axis and
+ * the work done by all ranks are stored in `metrics`. The host buffers are
+ * taken from `workspace`.
  */
 std::pair<int, double> cluster_serial_iteration(
     int num_rows,
@@ -120,14 +152,18 @@ std::pair<int, double> cluster_serial_iteration(
     const int* row_counts,
     const int* row_displacements,
     const int* col_counts,
-    const int* col_displacements) {
+    const int* col_displacements,
+    iteration_workspace* workspace,
+    iteration_metrics* metrics) {
 
     int num_rows_recv = row_counts[rank];
     int row_displacement = row_displacements[rank];
 
     //// SECTION: calculate_cluster_average
+    set_phase(PHASE_CLUSTER_AVERAGE);
+
     // Calculate the average value per cluster
-    auto cluster_avg = calculate_cluster_average(
+    calculate_cluster_average(
         num_rows,
         num_cols,
         num_row_labels,
@@ -136,15 +172,19 @@ std::pair<int, double> cluster_serial_iteration(
         row_labels,
         col_labels,
         row_displacement,
-        num_rows_recv);
+        num_rows_recv,
+        workspace);
+    const float* cluster_avg = workspace->cluster_avg.data();
 
     //// SECTION: update_row_labels
-    auto scatter_row_labels = std::vector<label_type>(num_rows_recv, 0);
+    set_phase(PHASE_ROW_UPDATE);
+
+    label_type* scatter_row_labels = workspace->scatter_row_labels.data();
     MPI_Scatterv(row_labels,
                 row_counts,
                 row_displacements,
                 MPI_INT,
-                scatter_row_labels.data(),
+                scatter_row_labels,
                 num_rows_recv,
                 MPI_INT,
                 0,
@@ -157,14 +197,14 @@ std::pair<int, double> cluster_serial_iteration(
         num_row_labels,
         num_col_labels,
         matrix,
-        scatter_row_labels.data(),
+        scatter_row_labels,
         col_labels,
-        cluster_avg.data(),
+        cluster_avg,
         row_displacement,
         num_rows_recv);
 
     // Synchronize row_labels and num_rows_updated
-    MPI_Allgatherv(scatter_row_labels.data(),
+    MPI_Allgatherv(scatter_row_labels,
                    num_rows_recv,
                    MPI_INT,
                    row_labels,
@@ -177,13 +217,15 @@ std::pair<int, double> cluster_serial_iteration(
     MPI_Barrier(MPI_COMM_WORLD);
 
     //// SECTION: update_col_labels
+    set_phase(PHASE_COL_UPDATE);
+
     int num_cols_recv = col_counts[rank];
-    auto scatter_col_labels = std::vector<label_type>(num_cols_recv, 0);
+    label_type* scatter_col_labels = workspace->scatter_col_labels.data();
     MPI_Scatterv(col_labels,
                 col_counts,
                 col_displacements,
                 MPI_INT,
-                scatter_col_labels.data(),
+                scatter_col_labels,
                 num_cols_recv,
                 MPI_INT,
                 0,
@@ -199,13 +241,13 @@ std::pair<int, double> cluster_serial_iteration(
         num_col_labels,
         matrix,
         row_labels,
-        scatter_col_labels.data(),
-        cluster_avg.data(),
+        scatter_col_labels,
+        cluster_avg,
         col_displacement,
         num_cols_recv);
 
     // Synchronize col_labels, num_cols_updated and total_dist
-    MPI_Allgatherv(scatter_col_labels.data(),
+    MPI_Allgatherv(scatter_col_labels,
                    num_cols_recv,
                    MPI_INT,
                    col_labels,
@@ -217,6 +259,13 @@ std::pair<int, double> cluster_serial_iteration(
     MPI_Allreduce(&num_cols_updated, &num_cols_updated, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
     MPI_Allreduce(&total_dist, &total_dist, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
 
+    set_phase(PHASE_OTHER);
+    metrics->rows_updated = num_rows_updated;
+    metrics->cols_updated = num_cols_updated;
+    metrics->objective = total_dist;
+    metrics->distance_evaluations =
+        double(num_rows) * num_cols * (num_row_labels + num_col_labels);
+
     return {num_rows_updated + num_cols_updated, total_dist};
 }
 
@@ -251,7 +300,19 @@ void cluster_serial(
     col_counts = col_scatter.first;
     col_displacements = col_scatter.second;
 
+    auto workspace = iteration_workspace(
+        num_row_labels,
+        num_col_labels,
+        num_cols,
+        row_counts[rank],
+        col_counts[rank]);
+
     while (iteration < max_iterations) {
+        TRACE_SCOPE("iteration", "iteration");
+        iteration_metrics metrics;
+        metrics_begin_iteration();
+        long allocations = heap_allocation_count();
+
         auto [num_updated, total_dist] = cluster_serial_iteration(
             num_rows,
             num_cols,
@@ -264,12 +325,19 @@ void cluster_serial(
             row_counts.data(),
             row_displacements.data(),
             col_counts.data(),
-            col_displacements.data());
+            col_displacements.data(),
+            &workspace,
+            &metrics);
+
+        if (iteration > 0) {
+            check_no_allocations(allocations, "cluster_serial_iteration");
+        }
 
         iteration++;
+        metrics_end_iteration(iteration, double(num_rows) * num_cols, metrics);
 
         if (rank == 0) {
-            auto average_dist = total_dist / (num_rows * num_cols);
+            auto average_dist = total_dist / (double(num_rows) * num_cols);
             std::cout << "iteration " << iteration << ": " << num_updated
                     << " labels were updated, average error is " << average_dist
                     << "\n";
@@ -286,14 +354,16 @@ void cluster_serial(
         std::cout << "clustering time total: " << time_seconds << " seconds\n";
         std::cout << "clustering time per iteration: " << (time_seconds / iteration)
                 << " seconds\n";
+        print_phase_times();
+        print_phase_counters(phase_counters, double(num_rows) * num_cols * iteration);
     }
 }
 
 int main(int argc, const char* argv[]) {
     MPI_Init(NULL, NULL);
 
-    std::string output_file;
-    std::vector<float> matrix;
+    std::string input_file, output_file;
+    std::vector<float> unused_matrix;
     std::vector<label_type> row_labels, col_labels;
     int num_rows = 0, num_cols = 0;
     int num_row_labels = 0, num_col_labels = 0;
@@ -302,37 +372,90 @@ int main(int argc, const char* argv[]) {
     auto before = std::chrono::high_resolution_clock::now();
 
     // Parse arguments
+    auto program = create_argument_parser(argv[0]);
+
     if (!parse_arguments(
+            program,
             argc,
             argv,
             &num_rows,
             &num_cols,
             &num_row_labels,
             &num_col_labels,
-            &matrix,
+            &unused_matrix,
             &row_labels,
             &col_labels,
             &output_file,
-            &max_iter)) {
+            &max_iter,
+            &input_file)) {
+        return EXIT_FAILURE;
+    }
+
+    // The matrix is copied to the GPU as float32, so only the in-memory
+    // strategy is supported
+    double memory_limit = 0;
+    matrix_strategy strategy;
+    std::string memory_limit_text = program.get("--memory-limit");
+
+    if ((!memory_limit_text.empty() && !parse_memory_size(memory_limit_text, &memory_limit))
+        || !select_matrix_strategy(
+            memory_limit,
+            double(num_rows) * num_cols,
+            1,
+            estimate_buffer_bytes(num_rows, num_cols, num_row_labels, num_col_labels),
+            &strategy)) {
+        return EXIT_FAILURE;
+    }
+
+    if (strategy != STRATEGY_IN_MEMORY) {
+        fprintf(stderr, "error: the matrix does not fit in the memory limit\n");
+        return EXIT_FAILURE;
+    }
+
+    matrix_storage matrix;
+
+    if (!load_matrix(input_file, num_rows, num_cols, strategy, &matrix)) {
         return EXIT_FAILURE;
     }
 
+    io_seconds += std::chrono::duration<double>(
+        std::chrono::high_resolution_clock::now() - before).count();
+
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+    std::string metrics_file = program.get("--metrics");
+
+    if (!metrics_file.empty() && rank == 0 && !metrics_open(metrics_file)) {
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+
+    if (program.get<bool>("--counters")) {
+        enable_phase_counters();
+    }
+
+    // All ranks start the trace clock after a barrier
+    std::string trace_file = program.get("--trace");
+
+    if (!trace_file.empty()) {
+        MPI_Barrier(MPI_COMM_WORLD);
+        trace_enable();
+    }
+
     // Cluster labels
     cluster_serial(
         num_rows,
         num_cols,
         num_row_labels,
         num_col_labels,
-        matrix.data(),
+        matrix.values.data(),
         row_labels.data(),
         col_labels.data(),
         max_iter);
 
-    int rank; 
-    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
-    
     if (rank == 0) {
         // Write resulting labels
+        auto write_before = std::chrono::high_resolution_clock::now();
         write_labels(
         output_file,
         num_rows,
@@ -342,8 +465,14 @@ int main(int argc, const char* argv[]) {
 
         auto after = std::chrono::high_resolution_clock::now();
         auto time_seconds = std::chrono::duration<double>(after - before).count();
+        io_seconds += std::chrono::duration<double>(after - write_before).count();
 
         std::cout << "total execution time: " << time_seconds << " seconds\n";
+        metrics_close(time_seconds);
+    }
+
+    if (!trace_file.empty() && !trace_write_all(MPI_COMM_WORLD, trace_file)) {
+        return EXIT_FAILURE;
     }
 
     return EXIT_SUCCESS;
@@ -29,7 +29,7 @@ __global__ void cluster_id_kernel(
 		for (int i = 0; i < num_rows; i++) {
 			int row_label = row_labels[i + row_displacement];
 			int col_label = col_labels[j];
-			cluster_ids[i * num_cols + j] = row_label * num_col_labels + col_label;
+			cluster_ids[size_t(i) * num_cols + j] = row_label * num_col_labels + col_label;
 		}
 	}
 }
@@ -54,7 +54,7 @@ void call_cluster_id_kernel(
 	int *d_col_labels;
 	cudaMalloc(&d_col_labels, num_cols*sizeof(int));
 	int *d_cluster_ids;
-	cudaMalloc(&d_cluster_ids, (num_rows_recv*num_cols)*sizeof(int));
+	cudaMalloc(&d_cluster_ids, size_t(num_rows_recv)*num_cols*sizeof(int));
 
 	// Copy data to device
 	cudaMemcpy(d_row_labels, row_labels, num_rows*sizeof(int), cudaMemcpyHostToDevice);
@@ -70,7 +70,7 @@ void call_cluster_id_kernel(
 		row_displacement);
 
 	// Copy results from device to host
-	cudaMemcpy(cluster_ids, d_cluster_ids, num_rows_recv*num_cols*sizeof(int), cudaMemcpyDeviceToHost);
+	cudaMemcpy(cluster_ids, d_cluster_ids, size_t(num_rows_recv)*num_cols*sizeof(int), cudaMemcpyDeviceToHost);
 
 	// Free allocated memory
 	cudaFree(d_row_labels);
@@ -82,7 +82,7 @@ __global__ void calculate_cluster_avg(
 	int num_row_labels,
 	int num_col_labels,
 	double* cluster_sum,
-	int* cluster_size,
+	int64_t* cluster_size,
 	float* cluster_avg) {
 
 	int i = blockIdx.x * blockDim.x + threadIdx.x;
@@ -97,7 +97,7 @@ void call_cluster_average_kernel(
 	int num_row_labels,
 	int num_col_labels,
 	double* cluster_sum,
-	int* cluster_size,
+	int64_t* cluster_size,
 	float* cluster_avg) {
 
 	int N = num_col_labels;
@@ -110,14 +110,14 @@ void call_cluster_average_kernel(
 	// Allocate memory on device
 	double *d_cluster_sum;
 	cudaMalloc(&d_cluster_sum, num_clusters*sizeof(double));
-	int *d_cluster_size;
-	cudaMalloc(&d_cluster_size, num_clusters*sizeof(int));
+	int64_t *d_cluster_size;
+	cudaMalloc(&d_cluster_size, num_clusters*sizeof(int64_t));
 	float *d_cluster_avg;
 	cudaMalloc(&d_cluster_avg, num_clusters*sizeof(float));
 
 	// Copy data to device
 	cudaMemcpy(d_cluster_sum, cluster_sum, num_clusters*sizeof(double), cudaMemcpyHostToDevice);
-	cudaMemcpy(d_cluster_size, cluster_size, num_clusters*sizeof(int), cudaMemcpyHostToDevice);
+	cudaMemcpy(d_cluster_size, cluster_size, num_clusters*sizeof(int64_t), cudaMemcpyHostToDevice);
 
 	calculate_cluster_avg <<< numBlocks, blockSize >>>(
 		num_row_labels,
@@ -151,7 +151,7 @@ __global__ void calculate_block_distance_row(
 	int tid = threadIdx.x;
 
 	if (j < num_cols) {
-		float item = matrix[i * num_cols + j];
+		float item = matrix[size_t(i) * num_cols + j];
 
 		int col_label = col_labels[j];
 
@@ -204,14 +204,14 @@ std::pair<int, double> call_update_row_labels_kernel(
 	double *d_dist_blocks;
 	cudaMalloc(&d_dist_blocks, bytes);
 	float *d_matrix;
-	cudaMalloc(&d_matrix, (num_rows*num_cols)*sizeof(float));
+	cudaMalloc(&d_matrix, size_t(num_rows)*num_cols*sizeof(float));
 	float *d_cluster_avg;
 	cudaMalloc(&d_cluster_avg, (num_row_labels*num_col_labels)*sizeof(float));
 	int *d_col_labels;
 	cudaMalloc(&d_col_labels, num_cols*sizeof(int));
 
 	// Copy data to device
-	cudaMemcpy(d_matrix, matrix, (num_rows*num_cols)*sizeof(float), cudaMemcpyHostToDevice);
+	cudaMemcpy(d_matrix, matrix, size_t(num_rows)*num_cols*sizeof(float), cudaMemcpyHostToDevice);
 	cudaMemcpy(d_cluster_avg, cluster_avg, (num_row_labels*num_col_labels)*sizeof(float), cudaMemcpyHostToDevice);
 	cudaMemcpy(d_col_labels, col_labels, num_cols*sizeof(int), cudaMemcpyHostToDevice);
 
@@ -299,7 +299,7 @@ __global__ void col_labels_iteration(
             double dist = 0;
 
             for (int i = 0; i < num_rows; i++) {
-                auto item = matrix[i * num_cols + j + displacement];
+                auto item = matrix[size_t(i) * num_cols + j + displacement];
 
                 auto row_label = row_labels[i];
                 auto col_label = k;
@@ -364,7 +364,7 @@ std::pair<int, double> call_update_col_labels_kernel(
 
 	// Allocate memory for data on device
 	float *d_matrix;
-	cudaMalloc(&d_matrix, (num_cols*num_rows)*sizeof(float));
+	cudaMalloc(&d_matrix, size_t(num_cols)*num_rows*sizeof(float));
 	float *d_cluster_avg;
 	cudaMalloc(&d_cluster_avg, (num_row_labels*num_col_labels)*sizeof(float));
 	int *d_col_labels;
@@ -377,7 +377,7 @@ std::pair<int, double> call_update_col_labels_kernel(
 	cudaMalloc(&d_total_dist_per_block, numBlocks*sizeof(double));
 
 	// Copy data to device
-	cudaMemcpy(d_matrix, matrix, (num_cols*num_rows)*sizeof(float), cudaMemcpyHostToDevice);
+	cudaMemcpy(d_matrix, matrix, size_t(num_cols)*num_rows*sizeof(float), cudaMemcpyHostToDevice);
 	cudaMemcpy(d_cluster_avg, cluster_avg, (num_row_labels*num_col_labels)*sizeof(float), cudaMemcpyHostToDevice);
 	cudaMemcpy(d_col_labels, col_labels, num_cols_recv*sizeof(int), cudaMemcpyHostToDevice);
 	cudaMemcpy(d_row_labels, row_labels, num_rows*sizeof(int), cudaMemcpyHostToDevice);
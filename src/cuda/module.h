@@ -1,3 +1,4 @@
+#include <cstdint>
 #include <iostream>
 
 void call_cluster_id_kernel(
@@ -14,7 +15,7 @@ void call_cluster_average_kernel(
 	int num_row_labels,
 	int num_col_labels,
 	double* cluster_sum,
-	int* cluster_size,
+	int64_t* cluster_size,
 	float* cluster_avg);
 
 std::pair<int, double> call_update_row_labels_kernel(
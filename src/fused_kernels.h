@@ -0,0 +1,270 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+
+#include "common.h"
+#include "memory.h"
+#include "serial_kernels.h"
+
+/*
+ * The kernels of the fused iteration of the serial implementation
+ * (`cgc_serial --fused`), which reads the matrix once per iteration instead
+ * of three times. The squared distances are expanded as
+ * sum (a - x)^2 = sum x^2 - 2 a sum x + n a^2, so that they only depend on
+ * sums of the matrix values per cluster:
+ *
+ *  - While updating the row labels, every row is summed per column label, and
+ *    once its new label is known, it is added to the sums of its row label
+ *    per column (`col_sum`) while it is still in cache.
+ *  - The column labels are then updated from these sums alone. The term
+ *    sum x^2 of a column is the same for all column labels, so it is only
+ *    needed for the total distance, which is the sum over all rows.
+ *  - The cluster sums for the next iteration follow from `col_sum` and the
+ *    new column labels, without reading the matrix again.
+ *
+ * The expansion rounds differently than the direct distances, so labels that
+ * are (nearly) tied can be resolved differently than by the other kernels.
+ *
+ * The memory cost is `col_sum`, which holds num_row_labels * num_cols doubles
+ * (e.g., 61 MiB for 1000000 columns and 8 row labels). Every matrix element
+ * reads and writes one of them, so once `col_sum` no longer fits in cache,
+ * this traffic can outweigh the saved passes over the matrix.
+ */
+
+/**
+ * The buffers of the fused iteration, in addition to `serial_workspace`, see
+ * `resize_fused_workspace`. `col_sum` has size (num_row_labels, num_cols), and
+ * `matrix_norm` is the sum of the squares of all matrix values.
+ */
+struct fused_workspace {
+    tracked_vector<double, MEMORY_DISTANCES> col_sum;
+    double matrix_norm = 0;
+    tracked_vector<double, MEMORY_CLUSTERS> row_sum;
+    tracked_vector<double, MEMORY_CLUSTERS> avg_norm;
+    tracked_vector<index_type, MEMORY_CLUSTERS> row_label_size;
+    tracked_vector<index_type, MEMORY_CLUSTERS> col_label_size;
+};
+
+/**
+ * Returns the size of the buffers allocated by `resize_fused_workspace`.
+ */
+static inline double estimate_fused_workspace_bytes(
+    int num_cols,
+    int num_row_labels,
+    int num_col_labels) {
+    return double(num_cols) * num_row_labels * sizeof(double)
+        + double(num_row_labels + num_col_labels) * (sizeof(double) + sizeof(index_type))
+        + double(num_col_labels) * sizeof(double);
+}
+
+static inline void resize_fused_workspace(
+    int num_cols,
+    int num_row_labels,
+    int num_col_labels,
+    fused_workspace* fused) {
+    fused->col_sum.resize(size_t(num_cols) * num_row_labels);
+    fused->row_sum.resize(num_col_labels);
+    fused->avg_norm.resize(num_row_labels);
+    fused->row_label_size.resize(num_row_labels);
+    fused->col_label_size.resize(num_col_labels);
+}
+
+/**
+ * Update the labels along the rows like `update_row_labels`, and accumulate
+ * the sums per row label and column of the updated labels into `fused`, see
+ * `update_fused_col_labels`. This is the only pass over the matrix.
+ */
+template<typename T>
+static std::pair<int, double> update_fused_row_labels(
+    int num_rows,
+    int num_cols,
+    int num_row_labels,
+    int num_col_labels,
+    const T* matrix,
+    label_type* row_labels,
+    const label_type* col_labels,
+    const typename compute_type<T>::type* cluster_avg,
+    fused_workspace* fused) {
+    using C = typename compute_type<T>::type;
+    double* col_sum = fused->col_sum.data();
+    double* row_sum = fused->row_sum.data();
+    double* avg_norm = fused->avg_norm.data();
+    index_type* col_label_size = fused->col_label_size.data();
+    int num_updated = 0;
+    double total_dist = 0;
+
+    std::fill(fused->col_sum.begin(), fused->col_sum.end(), 0.0);
+    fused->matrix_norm = 0;
+    std::fill(fused->row_label_size.begin(), fused->row_label_size.end(), 0);
+    std::fill(fused->col_label_size.begin(), fused->col_label_size.end(), 0);
+
+    for (int j = 0; j < num_cols; j++) {
+        col_label_size[col_labels[j]]++;
+    }
+
+    // The term n a^2 of every row label. Column labels without columns are
+    // skipped, since their averages are not defined.
+    for (int k = 0; k < num_row_labels; k++) {
+        avg_norm[k] = 0;
+
+        for (int c = 0; c < num_col_labels; c++) {
+            if (col_label_size[c] > 0) {
+                double y = cluster_avg[k * num_col_labels + c];
+                avg_norm[k] += double(col_label_size[c]) * y * y;
+            }
+        }
+    }
+
+    for (int i = 0; i < num_rows; i++) {
+        const T* row = &matrix[index_type(i) * num_cols];
+        double row_norm = 0;
+
+        std::fill(row_sum, row_sum + num_col_labels, 0.0);
+
+        for (int j = 0; j < num_cols; j++) {
+            C item = row[j];
+            row_sum[col_labels[j]] += item;
+            row_norm += double(item) * item;
+        }
+
+        int best_label = -1;
+        double best_dist = INFINITY;
+
+        for (int k = 0; k < num_row_labels; k++) {
+            double dot = 0;
+
+            for (int c = 0; c < num_col_labels; c++) {
+                if (col_label_size[c] > 0) {
+                    dot += double(cluster_avg[k * num_col_labels + c]) * row_sum[c];
+                }
+            }
+
+            double dist = row_norm - 2 * dot + avg_norm[k];
+
+            if (dist < best_dist) {
+                best_dist = dist;
+                best_label = k;
+            }
+        }
+
+        if (row_labels[i] != best_label) {
+            row_labels[i] = best_label;
+            num_updated++;
+        }
+
+        total_dist += best_dist;
+        fused->matrix_norm += row_norm;
+
+        if (best_label < 0) {
+            continue;
+        }
+
+        // The row is still in cache: add it to the sums of its new label
+        double* label_sum = &col_sum[index_type(best_label) * num_cols];
+        fused->row_label_size[best_label]++;
+
+        for (int j = 0; j < num_cols; j++) {
+            label_sum[j] += C(row[j]);
+        }
+    }
+
+    return {num_updated, total_dist};
+}
+
+/**
+ * Update the labels along the columns like `update_col_labels`, using only
+ * the sums accumulated by `update_fused_row_labels`. The distances leave out
+ * the sum of squares of every column, which is added to the total distance
+ * as `matrix_norm`.
+ */
+template<typename T>
+static std::pair<int, double> update_fused_col_labels(
+    int num_cols,
+    int num_row_labels,
+    int num_col_labels,
+    label_type* col_labels,
+    const typename compute_type<T>::type* cluster_avg,
+    const fused_workspace& fused) {
+    const index_type* row_label_size = fused.row_label_size.data();
+    int num_updated = 0;
+    double total_dist = 0;
+
+    for (int j = 0; j < num_cols; j++) {
+        int best_label = -1;
+        double best_dist = INFINITY;
+
+        for (int k = 0; k < num_col_labels; k++) {
+            double dist = 0;
+
+            // Row labels without rows are skipped, like in the row update
+            for (int r = 0; r < num_row_labels; r++) {
+                if (row_label_size[r] > 0) {
+                    double y = cluster_avg[r * num_col_labels + k];
+                    dist += double(row_label_size[r]) * y * y
+                        - 2 * y * fused.col_sum[index_type(r) * num_cols + j];
+                }
+            }
+
+            if (dist < best_dist) {
+                best_dist = dist;
+                best_label = k;
+            }
+        }
+
+        if (col_labels[j] != best_label) {
+            col_labels[j] = best_label;
+            num_updated++;
+        }
+
+        total_dist += best_dist;
+    }
+
+    return {num_updated, total_dist + fused.matrix_norm};
+}
+
+/**
+ * Calculate the cluster averages for the labels updated by
+ * `update_fused_row_labels` and `update_fused_col_labels`, like
+ * `calculate_cluster_average` but without reading the matrix.
+ */
+template<typename T>
+static void calculate_fused_cluster_average(
+    int num_cols,
+    int num_row_labels,
+    int num_col_labels,
+    const label_type* col_labels,
+    const fused_workspace& fused,
+    serial_workspace<T>* workspace) {
+    using C = typename compute_type<T>::type;
+    auto& cluster_sum = workspace->cluster_sum;
+    auto& cluster_size = workspace->cluster_size;
+    auto& cluster_avg = workspace->cluster_avg;
+
+    std::fill(cluster_sum.begin(), cluster_sum.end(), 0.0);
+
+    for (int r = 0; r < num_row_labels; r++) {
+        const double* label_sum = &fused.col_sum[index_type(r) * num_cols];
+
+        for (int j = 0; j < num_cols; j++) {
+            cluster_sum[r * num_col_labels + col_labels[j]] += label_sum[j];
+        }
+    }
+
+    std::fill(cluster_size.begin(), cluster_size.end(), 0);
+
+    for (int j = 0; j < num_cols; j++) {
+        for (int r = 0; r < num_row_labels; r++) {
+            cluster_size[r * num_col_labels + col_labels[j]] += fused.row_label_size[r];
+        }
+    }
+
+    for (int i = 0; i < num_row_labels; i++) {
+        for (int j = 0; j < num_col_labels; j++) {
+            auto index = i * num_col_labels + j;
+            cluster_avg[index] =
+                C(cluster_sum[index]) / C(cluster_size[index]);
+        }
+    }
+}
@@ -0,0 +1,379 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <type_traits>
+#include <utility>
+
+#ifdef CGC_USE_BLAS
+// OpenBLAS declares its own bfloat16, which clashes with the one of common.h
+#define bfloat16 cblas_bfloat16
+#include <cblas.h>
+#undef bfloat16
+#endif
+
+#include "common.h"
+#include "memory.h"
+#include "serial_kernels.h"
+
+/*
+ * The label updates of the serial implementation formulated as matrix
+ * multiplications (`cgc_serial --gemm`). The distance between row i and row
+ * label k expands to ||x_i||^2 - 2 x_i . a_k + ||a_k||^2, where
+ * a_k[j] = cluster_avg[k, col_labels[j]]. The dot products of all rows and
+ * row labels form the product of the matrix (num_rows, num_cols) with the
+ * matrix of the a_k (num_cols, num_row_labels), and likewise for the
+ * columns. With many labels, this moves the work into a GEMM, which reuses
+ * every matrix value for all labels from registers.
+ *
+ * The products are computed in blocks of `gemm_block_size` output rows and
+ * `gemm_block_depth` summed items, so that the block of the label matrix
+ * stays in cache. Within a block, the products are summed in float, and the
+ * blocks are summed in double. The cgc_serial_blas target uses cblas_sgemm
+ * of OpenBLAS (or any CBLAS) for float matrices instead of the bundled kernel.
+ *
+ * The expansion rounds differently than the direct distances, so labels that
+ * are (nearly) tied can be resolved differently than by the other kernels.
+ */
+
+static const int gemm_block_size = 128;
+static const int gemm_block_depth = 256;
+
+/**
+ * c += a b, where `a` has size (m, k), `b` has size (k, n) and `c` has size
+ * (m, n), all stored by row with leading dimensions `lda`, `ldb` and `ldc`.
+ */
+template<typename T>
+static void gemm_nn(
+    int m,
+    int n,
+    int k,
+    const T* a,
+    int lda,
+    const float* b,
+    int ldb,
+    float* c,
+    int ldc) {
+#ifdef CGC_USE_BLAS
+    if constexpr (std::is_same<T, float>::value) {
+        cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, m, n, k, 1.0f, a, lda, b, ldb, 1.0f, c, ldc);
+        return;
+    }
+#endif
+
+    for (int i = 0; i < m; i++) {
+        float* c_row = &c[i * ldc];
+
+        for (int l = 0; l < k; l++) {
+            float a_il = float(a[index_type(i) * lda + l]);
+            const float* b_row = &b[l * ldb];
+
+            for (int j = 0; j < n; j++) {
+                c_row[j] += a_il * b_row[j];
+            }
+        }
+    }
+}
+
+/**
+ * c += a^T b, where `a` has size (k, m), `b` has size (k, n) and `c` has
+ * size (m, n), all stored by row with leading dimensions `lda`, `ldb` and
+ * `ldc`.
+ */
+template<typename T>
+static void gemm_tn(
+    int m,
+    int n,
+    int k,
+    const T* a,
+    int lda,
+    const float* b,
+    int ldb,
+    float* c,
+    int ldc) {
+#ifdef CGC_USE_BLAS
+    if constexpr (std::is_same<T, float>::value) {
+        cblas_sgemm(CblasRowMajor, CblasTrans, CblasNoTrans, m, n, k, 1.0f, a, lda, b, ldb, 1.0f, c, ldc);
+        return;
+    }
+#endif
+
+    for (int l = 0; l < k; l++) {
+        const T* a_row = &a[index_type(l) * lda];
+        const float* b_row = &b[l * ldb];
+
+        for (int i = 0; i < m; i++) {
+            float a_li = float(a_row[i]);
+            float* c_row = &c[i * ldc];
+
+            for (int j = 0; j < n; j++) {
+                c_row[j] += a_li * b_row[j];
+            }
+        }
+    }
+}
+
+/**
+ * The buffers of the GEMM kernels, see `resize_gemm_workspace`. They hold
+ * one block: `panel` the label matrix of `gemm_block_depth` items, `partial`
+ * and `cross` the dot products of `gemm_block_size` rows or columns in float
+ * and double, and `norms` their squared norms.
+ */
+struct gemm_workspace {
+    tracked_vector<float, MEMORY_BUFFERS> panel;
+    tracked_vector<float, MEMORY_BUFFERS> partial;
+    tracked_vector<double, MEMORY_DISTANCES> cross;
+    tracked_vector<double, MEMORY_DISTANCES> norms;
+    tracked_vector<double, MEMORY_CLUSTERS> avg_norm;
+    tracked_vector<index_type, MEMORY_CLUSTERS> label_size;
+};
+
+/**
+ * Returns the size of the buffers allocated by `resize_gemm_workspace`.
+ */
+static inline double estimate_gemm_workspace_bytes(int num_row_labels, int num_col_labels) {
+    double num_labels = std::max(num_row_labels, num_col_labels);
+    return num_labels * (gemm_block_depth + gemm_block_size) * sizeof(float)
+        + num_labels * gemm_block_size * sizeof(double)
+        + gemm_block_size * sizeof(double)
+        + num_labels * (sizeof(double) + sizeof(index_type));
+}
+
+static inline void resize_gemm_workspace(
+    int num_row_labels,
+    int num_col_labels,
+    gemm_workspace* gemm) {
+    int num_labels = std::max(num_row_labels, num_col_labels);
+
+    gemm->panel.resize(size_t(gemm_block_depth) * num_labels);
+    gemm->partial.resize(size_t(gemm_block_size) * num_labels);
+    gemm->cross.resize(size_t(gemm_block_size) * num_labels);
+    gemm->norms.resize(gemm_block_size);
+    gemm->avg_norm.resize(num_labels);
+    gemm->label_size.resize(num_labels);
+}
+
+/**
+ * Like `update_row_labels`, but with the dot products of the rows and the
+ * row labels computed by `gemm_nn`.
+ */
+template<typename T>
+static std::pair<int, double> update_row_labels_gemm(
+    int num_rows,
+    int num_cols,
+    int num_row_labels,
+    int num_col_labels,
+    const T* matrix,
+    label_type* row_labels,
+    const label_type* col_labels,
+    const typename compute_type<T>::type* cluster_avg,
+    gemm_workspace* gemm) {
+    float* panel = gemm->panel.data();
+    float* partial = gemm->partial.data();
+    double* cross = gemm->cross.data();
+    double* norms = gemm->norms.data();
+    double* avg_norm = gemm->avg_norm.data();
+    index_type* col_label_size = gemm->label_size.data();
+    int num_updated = 0;
+    double total_dist = 0;
+
+    // ||a_k||^2, skipping the undefined averages of empty column labels
+    std::fill(col_label_size, col_label_size + num_col_labels, 0);
+
+    for (int j = 0; j < num_cols; j++) {
+        col_label_size[col_labels[j]]++;
+    }
+
+    for (int k = 0; k < num_row_labels; k++) {
+        avg_norm[k] = 0;
+
+        for (int c = 0; c < num_col_labels; c++) {
+            if (col_label_size[c] > 0) {
+                double y = cluster_avg[k * num_col_labels + c];
+                avg_norm[k] += double(col_label_size[c]) * y * y;
+            }
+        }
+    }
+
+    for (int row_begin = 0; row_begin < num_rows; row_begin += gemm_block_size) {
+        int block_rows = std::min(gemm_block_size, num_rows - row_begin);
+        const T* block = &matrix[index_type(row_begin) * num_cols];
+
+        std::fill(cross, cross + block_rows * num_row_labels, 0.0);
+        std::fill(norms, norms + block_rows, 0.0);
+
+        for (int col_begin = 0; col_begin < num_cols; col_begin += gemm_block_depth) {
+            int block_cols = std::min(gemm_block_depth, num_cols - col_begin);
+
+            // panel[l, k] = a_k[col_begin + l]
+            for (int l = 0; l < block_cols; l++) {
+                int col_label = col_labels[col_begin + l];
+
+                for (int k = 0; k < num_row_labels; k++) {
+                    panel[l * num_row_labels + k] = float(cluster_avg[k * num_col_labels + col_label]);
+                }
+            }
+
+            std::fill(partial, partial + block_rows * num_row_labels, 0.0f);
+            gemm_nn(
+                block_rows,
+                num_row_labels,
+                block_cols,
+                block + col_begin,
+                num_cols,
+                panel,
+                num_row_labels,
+                partial,
+                num_row_labels);
+
+            for (int index = 0; index < block_rows * num_row_labels; index++) {
+                cross[index] += partial[index];
+            }
+
+            for (int i = 0; i < block_rows; i++) {
+                const T* row = &block[index_type(i) * num_cols + col_begin];
+
+                for (int l = 0; l < block_cols; l++) {
+                    double item = float(row[l]);
+                    norms[i] += item * item;
+                }
+            }
+        }
+
+        for (int i = 0; i < block_rows; i++) {
+            int best_label = -1;
+            double best_dist = INFINITY;
+
+            for (int k = 0; k < num_row_labels; k++) {
+                double dist = norms[i] - 2 * cross[i * num_row_labels + k] + avg_norm[k];
+
+                if (dist < best_dist) {
+                    best_dist = dist;
+                    best_label = k;
+                }
+            }
+
+            if (row_labels[row_begin + i] != best_label) {
+                row_labels[row_begin + i] = best_label;
+                num_updated++;
+            }
+
+            total_dist += best_dist;
+        }
+    }
+
+    return {num_updated, total_dist};
+}
+
+/**
+ * Like `update_col_labels`, but with the dot products of the columns and the
+ * column labels computed by `gemm_tn`. Every block of columns reads its part
+ * of all rows, so the matrix is read by row.
+ */
+template<typename T>
+static std::pair<int, double> update_col_labels_gemm(
+    int num_rows,
+    int num_cols,
+    int num_row_labels,
+    int num_col_labels,
+    const T* matrix,
+    const label_type* row_labels,
+    label_type* col_labels,
+    const typename compute_type<T>::type* cluster_avg,
+    gemm_workspace* gemm) {
+    float* panel = gemm->panel.data();
+    float* partial = gemm->partial.data();
+    double* cross = gemm->cross.data();
+    double* norms = gemm->norms.data();
+    double* avg_norm = gemm->avg_norm.data();
+    index_type* row_label_size = gemm->label_size.data();
+    int num_updated = 0;
+    double total_dist = 0;
+
+    // ||b_k||^2, skipping the undefined averages of empty row labels
+    std::fill(row_label_size, row_label_size + num_row_labels, 0);
+
+    for (int i = 0; i < num_rows; i++) {
+        row_label_size[row_labels[i]]++;
+    }
+
+    for (int k = 0; k < num_col_labels; k++) {
+        avg_norm[k] = 0;
+
+        for (int r = 0; r < num_row_labels; r++) {
+            if (row_label_size[r] > 0) {
+                double y = cluster_avg[r * num_col_labels + k];
+                avg_norm[k] += double(row_label_size[r]) * y * y;
+            }
+        }
+    }
+
+    for (int col_begin = 0; col_begin < num_cols; col_begin += gemm_block_size) {
+        int block_cols = std::min(gemm_block_size, num_cols - col_begin);
+
+        std::fill(cross, cross + block_cols * num_col_labels, 0.0);
+        std::fill(norms, norms + block_cols, 0.0);
+
+        for (int row_begin = 0; row_begin < num_rows; row_begin += gemm_block_depth) {
+            int block_rows = std::min(gemm_block_depth, num_rows - row_begin);
+            const T* block = &matrix[index_type(row_begin) * num_cols + col_begin];
+
+            // panel[l, k] = cluster_avg[row_labels[row_begin + l], k]
+            for (int l = 0; l < block_rows; l++) {
+                const auto* avg = &cluster_avg[row_labels[row_begin + l] * num_col_labels];
+
+                for (int k = 0; k < num_col_labels; k++) {
+                    panel[l * num_col_labels + k] = float(avg[k]);
+                }
+            }
+
+            std::fill(partial, partial + block_cols * num_col_labels, 0.0f);
+            gemm_tn(
+                block_cols,
+                num_col_labels,
+                block_rows,
+                block,
+                num_cols,
+                panel,
+                num_col_labels,
+                partial,
+                num_col_labels);
+
+            for (int index = 0; index < block_cols * num_col_labels; index++) {
+                cross[index] += partial[index];
+            }
+
+            for (int l = 0; l < block_rows; l++) {
+                const T* row = &block[index_type(l) * num_cols];
+
+                for (int j = 0; j < block_cols; j++) {
+                    double item = float(row[j]);
+                    norms[j] += item * item;
+                }
+            }
+        }
+
+        for (int j = 0; j < block_cols; j++) {
+            int best_label = -1;
+            double best_dist = INFINITY;
+
+            for (int k = 0; k < num_col_labels; k++) {
+                double dist = norms[j] - 2 * cross[j * num_col_labels + k] + avg_norm[k];
+
+                if (dist < best_dist) {
+                    best_dist = dist;
+                    best_label = k;
+                }
+            }
+
+            if (col_labels[col_begin + j] != best_label) {
+                col_labels[col_begin + j] = best_label;
+                num_updated++;
+            }
+
+            total_dist += best_dist;
+        }
+    }
+
+    return {num_updated, total_dist};
+}
@@ -0,0 +1,314 @@
+#include <chrono>
+#include <cmath>
+#include <fcntl.h>
+#include <iostream>
+#include <sstream>
+#include <unistd.h>
+
+#include "common.h"
+
+/**
+ * Derive a well-mixed 64-bit seed from `seed` and `index` (splitmix64), so
+ * that each row has its own random stream independent of the thread that
+ * generates it.
+ */
+static uint64_t mix_seed(uint64_t seed, uint64_t index) {
+    uint64_t z = seed + (index + 1) * 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/**
+ * Returns the cumulative probabilities of `num_labels` labels, where label
+ * `k` has a weight of (1 - imbalance)^k. An imbalance of zero gives labels
+ * of equal size.
+ */
+static std::vector<double> label_distribution(int num_labels, double imbalance) {
+    auto cumulative = std::vector<double>(num_labels);
+    double total = 0;
+
+    for (int k = 0; k < num_labels; k++) {
+        total += std::pow(1.0 - imbalance, k);
+        cumulative[k] = total;
+    }
+
+    for (int k = 0; k < num_labels; k++) {
+        cumulative[k] /= total;
+    }
+
+    return cumulative;
+}
+
+template<typename R>
+static label_type sample_label(const std::vector<double>& cumulative, R& rng) {
+    double u = std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+    auto it = std::upper_bound(cumulative.begin(), cumulative.end(), u);
+    return label_type(std::min(it - cumulative.begin(), long(cumulative.size()) - 1));
+}
+
+/**
+ * Settings of the generated matrix. Row `i` is a duplicate of an earlier row
+ * with probability `duplicates`, in which case its values and label are
+ * copied from that row.
+ */
+struct generator {
+    long num_rows;
+    long num_cols;
+    int num_row_labels;
+    int num_col_labels;
+    float noise;
+    double duplicates;
+    uint64_t seed;
+    std::vector<float> cluster_means;
+    std::vector<label_type> row_labels;
+    std::vector<label_type> col_labels;
+    std::vector<long> row_sources;
+};
+
+static generator create_generator(
+    long num_rows,
+    long num_cols,
+    int num_row_labels,
+    int num_col_labels,
+    float noise,
+    double imbalance,
+    double duplicates,
+    uint64_t seed) {
+    generator gen;
+    gen.num_rows = num_rows;
+    gen.num_cols = num_cols;
+    gen.num_row_labels = num_row_labels;
+    gen.num_col_labels = num_col_labels;
+    gen.noise = noise;
+    gen.duplicates = duplicates;
+    gen.seed = seed;
+    auto rng = std::mt19937_64(seed);
+
+    // The planted value of each co-cluster
+    auto mean_dist = std::uniform_real_distribution<float>(-5.0f, 5.0f);
+    gen.cluster_means.resize(num_row_labels * num_col_labels);
+
+    for (auto& mean : gen.cluster_means) {
+        mean = mean_dist(rng);
+    }
+
+    auto row_dist = label_distribution(num_row_labels, imbalance);
+    auto col_dist = label_distribution(num_col_labels, imbalance);
+    gen.col_labels.resize(num_cols);
+
+    for (long j = 0; j < num_cols; j++) {
+        gen.col_labels[j] = sample_label(col_dist, rng);
+    }
+
+    // Each row is either original or a copy of an earlier original row
+    gen.row_labels.resize(num_rows);
+    gen.row_sources.resize(num_rows);
+
+    for (long i = 0; i < num_rows; i++) {
+        bool duplicate = i > 0
+            && std::uniform_real_distribution<double>(0.0, 1.0)(rng) < duplicates;
+
+        if (duplicate) {
+            long source = std::uniform_int_distribution<long>(0, i - 1)(rng);
+            gen.row_sources[i] = gen.row_sources[source];
+            gen.row_labels[i] = gen.row_labels[source];
+        } else {
+            gen.row_sources[i] = i;
+            gen.row_labels[i] = sample_label(row_dist, rng);
+        }
+    }
+
+    return gen;
+}
+
+/**
+ * Generate the values of row `i` into `row`. The random stream depends only
+ * on the seed and the source row, so the output does not depend on the number
+ * of threads and duplicated rows are exact copies.
+ */
+static void generate_row(const generator& gen, long i, float* row) {
+    long source = gen.row_sources[i];
+    auto rng = std::mt19937_64(mix_seed(gen.seed, source));
+    auto normal = std::normal_distribution<float>(0.0f, 1.0f);
+    const float* means = &gen.cluster_means[gen.row_labels[i] * gen.num_col_labels];
+
+    for (long j = 0; j < gen.num_cols; j++) {
+        row[j] = means[gen.col_labels[j]] + gen.noise * normal(rng);
+    }
+}
+
+static bool write_matrix(const generator& gen, const std::string& file_name) {
+    auto header = std::ostringstream {};
+    auto dtype = npy::dtype_map.at(std::type_index(typeid(float)));
+    npy::write_header(
+        header,
+        npy::header_t {
+            dtype,
+            false,
+            {(unsigned long)gen.num_rows, (unsigned long)gen.num_cols}});
+    auto header_bytes = header.str();
+
+    int fd = open(file_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd < 0) {
+        fprintf(stderr, "error: could not open: %s\n", file_name.c_str());
+        return false;
+    }
+
+    bool ok = pwrite(fd, header_bytes.data(), header_bytes.size(), 0)
+        == ssize_t(header_bytes.size());
+
+    // Each thread generates blocks of rows of roughly 4 MB and writes them
+    // directly to their final position in the file
+    size_t row_bytes = gen.num_cols * sizeof(float);
+    long rows_per_block = std::max(1L, long((4 << 20) / row_bytes));
+    long num_blocks = (gen.num_rows + rows_per_block - 1) / rows_per_block;
+
+#pragma omp parallel reduction(&& : ok)
+    {
+        auto buffer = std::vector<float>(rows_per_block * gen.num_cols);
+
+#pragma omp for schedule(dynamic)
+        for (long block = 0; block < num_blocks; block++) {
+            long row_begin = block * rows_per_block;
+            long row_end = std::min(row_begin + rows_per_block, gen.num_rows);
+
+            for (long i = row_begin; i < row_end; i++) {
+                generate_row(gen, i, &buffer[(i - row_begin) * gen.num_cols]);
+            }
+
+            const char* data = reinterpret_cast<const char*>(buffer.data());
+            size_t remaining = (row_end - row_begin) * row_bytes;
+            off_t offset = header_bytes.size() + row_begin * row_bytes;
+
+            while (ok && remaining > 0) {
+                ssize_t written = pwrite(fd, data, remaining, offset);
+
+                if (written <= 0) {
+                    ok = false;
+                    break;
+                }
+
+                data += written;
+                remaining -= written;
+                offset += written;
+            }
+        }
+    }
+
+    if (close(fd) != 0 || !ok) {
+        fprintf(stderr, "error: error occurred while writing file: %s\n", file_name.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+int main(int argc, const char* argv[]) {
+    auto program = argparse::ArgumentParser(argv[0]);
+    program.add_argument("output")
+        .help("Path to the output file in NPY format");
+
+    program.add_argument("--rows", "-r")
+        .scan<'i', long>()
+        .help("Number of rows")
+        .required();
+
+    program.add_argument("--cols", "-c")
+        .scan<'i', long>()
+        .help("Number of columns")
+        .required();
+
+    program.add_argument("--row-labels")
+        .scan<'i', int>()
+        .help("Number of planted row clusters")
+        .default_value(5);
+
+    program.add_argument("--col-labels")
+        .scan<'i', int>()
+        .help("Number of planted column clusters")
+        .default_value(20);
+
+    program.add_argument("--noise")
+        .scan<'g', float>()
+        .help("Standard deviation of the Gaussian noise")
+        .default_value(1.0f);
+
+    program.add_argument("--imbalance")
+        .scan<'g', double>()
+        .help("Label imbalance in [0, 1): label k has weight (1 - imbalance)^k")
+        .default_value(0.0);
+
+    program.add_argument("--duplicates")
+        .scan<'g', double>()
+        .help("Fraction of rows that duplicate an earlier row")
+        .default_value(0.0);
+
+    program.add_argument("--seed", "-s")
+        .scan<'i', int>()
+        .help("Random seed")
+        .default_value(1);
+
+    program.add_argument("--labels", "-l")
+        .help("Path to the output file for the ground-truth labels")
+        .default_value(std::string(""));
+
+    try {
+        program.parse_args(argc, argv);
+    } catch (const std::runtime_error& err) {
+        fprintf(stderr, "error: %s\n", err.what());
+        return EXIT_FAILURE;
+    }
+
+    long num_rows = program.get<long>("--rows");
+    long num_cols = program.get<long>("--cols");
+    int num_row_labels = program.get<int>("--row-labels");
+    int num_col_labels = program.get<int>("--col-labels");
+    double imbalance = program.get<double>("--imbalance");
+
+    if (num_rows <= 0 || num_cols <= 0 || num_row_labels <= 0 || num_col_labels <= 0
+        || imbalance < 0 || imbalance >= 1) {
+        fprintf(stderr, "error: invalid matrix or label configuration\n");
+        return EXIT_FAILURE;
+    }
+
+    auto before = std::chrono::high_resolution_clock::now();
+
+    auto gen = create_generator(
+        num_rows,
+        num_cols,
+        num_row_labels,
+        num_col_labels,
+        program.get<float>("--noise"),
+        imbalance,
+        program.get<double>("--duplicates"),
+        program.get<int>("--seed"));
+
+    std::string output_file = program.get("output");
+    fprintf(stderr, "writing %ld x %ld matrix to %s\n", num_rows, num_cols, output_file.c_str());
+
+    if (!write_matrix(gen, output_file)) {
+        return EXIT_FAILURE;
+    }
+
+    std::string labels_file = program.get("--labels");
+
+    if (!labels_file.empty()) {
+        write_labels(
+            labels_file,
+            int(num_rows),
+            int(num_cols),
+            gen.row_labels.data(),
+            gen.col_labels.data());
+    }
+
+    auto after = std::chrono::high_resolution_clock::now();
+    auto time_seconds = std::chrono::duration<double>(after - before).count();
+    double gigabytes = double(num_rows) * num_cols * sizeof(float) / 1e9;
+
+    std::cout << "generated " << gigabytes << " GB in " << time_seconds
+              << " seconds (" << (gigabytes / time_seconds) << " GB/s)\n";
+
+    return EXIT_SUCCESS;
+}
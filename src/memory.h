@@ -0,0 +1,461 @@
+#pragma once
+
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <iostream>
+#include <new>
+#include <string>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <vector>
+
+#include "common.h"
+#include "trace.h"
+
+/**
+ * Memory accounting. Buffers owned by the implementations are allocated with
+ * `tracking_allocator` (or registered with `memory_track`), which keeps the
+ * current and peak number of bytes per component. The accounting is not
+ * thread-safe: allocations must happen outside of parallel regions.
+ */
+enum memory_component {
+    MEMORY_MATRIX,
+    MEMORY_LABELS,
+    MEMORY_CLUSTERS,
+    MEMORY_DISTANCES,
+    MEMORY_BUFFERS,
+    NUM_MEMORY_COMPONENTS
+};
+
+static const char* memory_component_names[NUM_MEMORY_COMPONENTS] = {
+    "matrix",
+    "labels",
+    "cluster statistics",
+    "distances",
+    "buffers",
+};
+
+static double memory_current[NUM_MEMORY_COMPONENTS];
+static double memory_peak[NUM_MEMORY_COMPONENTS];
+static double memory_total_current = 0;
+static double memory_total_peak = 0;
+
+static inline void memory_track(memory_component component, double bytes) {
+    memory_current[component] += bytes;
+    memory_peak[component] = std::max(memory_peak[component], memory_current[component]);
+    memory_total_current += bytes;
+    memory_total_peak = std::max(memory_total_peak, memory_total_current);
+}
+
+/**
+ * Allocator that records its allocations under `Component`. Allocations are
+ * aligned to cache lines.
+ */
+template<typename T, memory_component Component>
+struct tracking_allocator {
+    using value_type = T;
+    static constexpr std::align_val_t alignment {64};
+
+    template<typename U>
+    struct rebind {
+        using other = tracking_allocator<U, Component>;
+    };
+
+    tracking_allocator() = default;
+
+    template<typename U>
+    tracking_allocator(const tracking_allocator<U, Component>&) {}
+
+    T* allocate(size_t n) {
+        auto* p = static_cast<T*>(::operator new(n * sizeof(T), alignment));
+        memory_track(Component, double(n * sizeof(T)));
+        return p;
+    }
+
+    void deallocate(T* p, size_t n) {
+        memory_track(Component, -double(n * sizeof(T)));
+        ::operator delete(p, alignment);
+    }
+
+    template<typename U>
+    bool operator==(const tracking_allocator<U, Component>&) const {
+        return true;
+    }
+
+    template<typename U>
+    bool operator!=(const tracking_allocator<U, Component>&) const {
+        return false;
+    }
+};
+
+template<typename T, memory_component Component>
+using tracked_vector = std::vector<T, tracking_allocator<T, Component>>;
+
+/**
+ * Counting of heap allocations, to verify that the iterations after the
+ * first do not allocate memory: all of their buffers should be in a workspace
+ * that is allocated once per run. Compile with -DCGC_CHECK_ALLOCATIONS to
+ * replace the global operator new by one that counts the allocations (each
+ * binary is a single translation unit, so the replacement is defined here).
+ */
+#ifdef CGC_CHECK_ALLOCATIONS
+static std::atomic<long> heap_allocations {0};
+
+void* operator new(size_t size) {
+    heap_allocations++;
+    void* p = malloc(size == 0 ? 1 : size);
+
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+
+    return p;
+}
+
+void* operator new(size_t size, std::align_val_t alignment) {
+    heap_allocations++;
+    void* p = nullptr;
+
+    if (posix_memalign(&p, std::max(size_t(alignment), sizeof(void*)), size == 0 ? 1 : size)
+        != 0) {
+        throw std::bad_alloc();
+    }
+
+    return p;
+}
+#endif
+
+static inline long heap_allocation_count() {
+#ifdef CGC_CHECK_ALLOCATIONS
+    return heap_allocations;
+#else
+    return 0;
+#endif
+}
+
+/**
+ * Abort if memory was allocated since `heap_allocation_count` returned
+ * `before`. Tracing appends to growing buffers, so nothing is checked while
+ * it is enabled.
+ */
+static inline void check_no_allocations(long before, const char* where) {
+    long count = heap_allocation_count() - before;
+
+    if (count != 0 && !trace_enabled) {
+        fprintf(stderr, "error: %ld heap allocations in %s\n", count, where);
+        abort();
+    }
+}
+
+/**
+ * The peak resident set size of this process in bytes.
+ */
+static inline double peak_resident_bytes() {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return double(usage.ru_maxrss) * 1024;
+}
+
+/**
+ * Print the peak memory use of each component, the peak of their sum and the
+ * peak resident set size. `peaks` holds NUM_MEMORY_COMPONENTS + 2 values in
+ * that order, see `memory_peaks`.
+ */
+static inline void print_memory_usage(const double* peaks) {
+    for (int i = 0; i < NUM_MEMORY_COMPONENTS; i++) {
+        std::cout << "peak memory of " << memory_component_names[i] << ": "
+                  << (peaks[i] / (1 << 20)) << " MiB\n";
+    }
+
+    std::cout << "peak memory tracked: " << (peaks[NUM_MEMORY_COMPONENTS] / (1 << 20))
+              << " MiB\n";
+    std::cout << "peak resident memory: " << (peaks[NUM_MEMORY_COMPONENTS + 1] / (1 << 20))
+              << " MiB\n";
+}
+
+static inline void memory_peaks(double* peaks) {
+    std::copy(memory_peak, memory_peak + NUM_MEMORY_COMPONENTS, peaks);
+    peaks[NUM_MEMORY_COMPONENTS] = memory_total_peak;
+    peaks[NUM_MEMORY_COMPONENTS + 1] = peak_resident_bytes();
+}
+
+/**
+ * Parse a memory size such as "512M", "16G" or "1.5T" (powers of 1024) or a
+ * plain number of bytes.
+ */
+static inline bool parse_memory_size(const std::string& text, double* bytes_out) {
+    size_t end = 0;
+    double value;
+
+    try {
+        value = std::stod(text, &end);
+    } catch (const std::exception&) {
+        end = 0;
+    }
+
+    std::string suffix = text.substr(end);
+    const std::string units = "KMGT";
+    double scale = 1;
+
+    if (end == 0 || suffix.size() > 1 || value <= 0) {
+        fprintf(stderr, "error: invalid memory size: %s\n", text.c_str());
+        return false;
+    }
+
+    if (!suffix.empty()) {
+        auto unit = units.find(char(toupper(suffix[0])));
+
+        if (unit == std::string::npos) {
+            fprintf(stderr, "error: invalid memory size: %s\n", text.c_str());
+            return false;
+        }
+
+        scale = double(1L << (10 * (unit + 1)));
+    }
+
+    *bytes_out = value * scale;
+    return true;
+}
+
+/**
+ * Estimate the memory needed besides the matrix by a process that holds all
+ * labels and the cluster statistics of all clusters.
+ */
+static inline double estimate_buffer_bytes(
+    int num_rows,
+    int num_cols,
+    int num_row_labels,
+    int num_col_labels) {
+    double num_clusters = double(num_row_labels) * num_col_labels;
+    return (double(num_rows) + num_cols) * sizeof(label_type)
+        + num_clusters * (sizeof(double) + sizeof(index_type) + sizeof(float));
+}
+
+/**
+ * How the matrix is kept in memory. In order of preference: as float32, as
+ * bfloat16 (half the memory, but the values lose precision) or memory-mapped
+ * from the input file, in which case the operating system pages it in from
+ * disk as needed and it does not count against the resident memory.
+ */
+enum matrix_strategy {
+    STRATEGY_IN_MEMORY,
+    STRATEGY_REDUCED_PRECISION,
+    STRATEGY_OUT_OF_CORE,
+    NUM_STRATEGIES
+};
+
+static inline const char* matrix_strategy_name(matrix_strategy strategy) {
+    switch (strategy) {
+        case STRATEGY_IN_MEMORY:
+            return "in-memory";
+        case STRATEGY_REDUCED_PRECISION:
+            return "reduced precision (bfloat16)";
+        default:
+            return "out-of-core (memory-mapped)";
+    }
+}
+
+static inline double matrix_strategy_bytes(matrix_strategy strategy, double num_elements) {
+    switch (strategy) {
+        case STRATEGY_IN_MEMORY:
+            return num_elements * sizeof(float);
+        case STRATEGY_REDUCED_PRECISION:
+            return num_elements * sizeof(bfloat16);
+        default:
+            return 0;
+    }
+}
+
+/**
+ * Select the first strategy for which `num_copies` copies of a matrix of
+ * `num_elements` elements plus `other_bytes` fit in `limit` bytes. A limit
+ * of zero means no limit. Returns false if even the out-of-core strategy
+ * does not fit, since the other buffers are too large.
+ */
+static inline bool select_matrix_strategy(
+    double limit,
+    double num_elements,
+    int num_copies,
+    double other_bytes,
+    matrix_strategy* strategy_out) {
+    for (int i = 0; i < NUM_STRATEGIES; i++) {
+        auto strategy = matrix_strategy(i);
+        double bytes = num_copies * matrix_strategy_bytes(strategy, num_elements) + other_bytes;
+
+        if (limit == 0 || bytes <= limit) {
+            *strategy_out = strategy;
+            return true;
+        }
+    }
+
+    fprintf(
+        stderr,
+        "error: memory limit of %.3g MiB is too small, at least %.3g MiB is needed\n",
+        limit / (1 << 20),
+        other_bytes / (1 << 20));
+    return false;
+}
+
+/**
+ * Read `count` floats starting at byte `offset` of the file `file_name` and
+ * store them as bfloat16 in `matrix`. The file is read in chunks, so no
+ * float32 copy of the matrix is needed.
+ */
+static inline bool read_matrix_data(
+    const std::string& file_name,
+    size_t offset,
+    size_t count,
+    bfloat16* matrix) {
+    std::ifstream stream(file_name, std::ifstream::binary);
+    stream.seekg(offset);
+
+    auto chunk = std::vector<float>(1 << 20);
+
+    for (size_t begin = 0; begin < count && stream; begin += chunk.size()) {
+        size_t n = std::min(chunk.size(), count - begin);
+        stream.read(reinterpret_cast<char*>(chunk.data()), n * sizeof(float));
+
+        for (size_t i = 0; i < n; i++) {
+            matrix[begin + i] = bfloat16(chunk[i]);
+        }
+    }
+
+    if (!stream) {
+        fprintf(
+            stderr,
+            "error: error occurred while reading file: %s\n",
+            file_name.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * The input matrix of a process, stored according to `strategy`: `values`
+ * holds the float32 matrix, `reduced_values` the bfloat16 matrix, and
+ * `mapping` the memory-mapped input file, with the matrix at `mapped_values`.
+ */
+struct matrix_storage {
+    matrix_strategy strategy = STRATEGY_IN_MEMORY;
+    tracked_vector<float, MEMORY_MATRIX> values;
+    tracked_vector<bfloat16, MEMORY_MATRIX> reduced_values;
+    void* mapping = nullptr;
+    size_t mapping_size = 0;
+    const float* mapped_values = nullptr;
+};
+
+/**
+ * Memory-map the matrix in the NPY file `file_name` read-only. Returns the
+ * address of the matrix, or nullptr on failure.
+ */
+static inline const float* map_matrix(
+    const std::string& file_name,
+    size_t num_items,
+    void** mapping_out,
+    size_t* mapping_size_out) {
+    std::vector<unsigned long> shape;
+    size_t data_offset;
+    read_matrix_header(file_name, &shape, &data_offset);
+
+    int fd = open(file_name.c_str(), O_RDONLY);
+    size_t size = data_offset + num_items * sizeof(float);
+    void* mapping = fd < 0 ? MAP_FAILED : mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    if (mapping == MAP_FAILED) {
+        fprintf(stderr, "error: could not map: %s\n", file_name.c_str());
+        return nullptr;
+    }
+
+    *mapping_out = mapping;
+    *mapping_size_out = size;
+    return reinterpret_cast<const float*>(static_cast<const char*>(mapping) + data_offset);
+}
+
+/**
+ * Returns false, after printing an error, if one of the `num_rows` by
+ * `num_cols` values of `matrix` is NaN. The kernels do not support missing
+ * values: a NaN makes the distances of its row and column to all labels NaN,
+ * so these would not get a label.
+ */
+template<typename T>
+static bool check_matrix_values(
+    const std::string& file_name,
+    int num_rows,
+    int num_cols,
+    const T* matrix) {
+    size_t num_items = size_t(num_rows) * size_t(num_cols);
+
+    for (size_t i = 0; i < num_items; i++) {
+        if (std::isnan(float(matrix[i]))) {
+            fprintf(
+                stderr,
+                "error: %s has a missing value (NaN) at row %zu, column %zu, which is not supported\n",
+                file_name.c_str(),
+                i / num_cols,
+                i % num_cols);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Load the matrix in the NPY file `file_name` as given by `strategy`. The
+ * values are checked by `check_matrix_values`, which reads a memory-mapped
+ * matrix once.
+ */
+static inline bool load_matrix(
+    const std::string& file_name,
+    int num_rows,
+    int num_cols,
+    matrix_strategy strategy,
+    matrix_storage* storage) {
+    size_t num_items = size_t(num_rows) * size_t(num_cols);
+    std::vector<unsigned long> shape;
+    size_t data_offset;
+    read_matrix_header(file_name, &shape, &data_offset);
+    storage->strategy = strategy;
+
+    switch (strategy) {
+        case STRATEGY_IN_MEMORY:
+            storage->values.resize(num_items);
+            return read_matrix_data(file_name, data_offset, num_items, storage->values.data())
+                && check_matrix_values(file_name, num_rows, num_cols, storage->values.data());
+        case STRATEGY_REDUCED_PRECISION:
+            storage->reduced_values.resize(num_items);
+            return read_matrix_data(
+                       file_name,
+                       data_offset,
+                       num_items,
+                       storage->reduced_values.data())
+                && check_matrix_values(file_name, num_rows, num_cols, storage->reduced_values.data());
+        default:
+            storage->mapped_values = map_matrix(
+                file_name,
+                num_items,
+                &storage->mapping,
+                &storage->mapping_size);
+            return storage->mapped_values != nullptr
+                && check_matrix_values(file_name, num_rows, num_cols, storage->mapped_values);
+    }
+}
+
+static inline void unload_matrix(matrix_storage* storage) {
+    storage->values = {};
+    storage->reduced_values = {};
+
+    if (storage->mapping != nullptr) {
+        munmap(storage->mapping, storage->mapping_size);
+        storage->mapping = nullptr;
+    }
+}
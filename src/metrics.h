@@ -0,0 +1,126 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <string>
+
+#include "timing.h"
+
+/**
+ * Machine-readable progress of a clustering run. With `--metrics FILE`, one
+ * JSON object per line (JSON Lines) is written for every iteration, followed
+ * by a summary object at the end of the run. The file is flushed after every
+ * line, so it can be followed while the job is running.
+ */
+struct iteration_metrics {
+    int rows_updated = 0;
+    int cols_updated = 0;
+    double objective = 0;
+    double distance_evaluations = 0;
+};
+
+static FILE* metrics_file = nullptr;
+static double metrics_phase_seconds[NUM_PHASES];
+static double metrics_communication_seconds = 0;
+static double metrics_io_seconds = 0;
+static int metrics_iterations = 0;
+static auto metrics_iteration_start = std::chrono::high_resolution_clock::now();
+
+static inline bool metrics_open(const std::string& file_name) {
+    metrics_file = fopen(file_name.c_str(), "w");
+
+    if (metrics_file == nullptr) {
+        fprintf(stderr, "error: could not open: %s\n", file_name.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Remember the time spent in each phase so far, so that `metrics_end_iteration`
+ * can report the time spent in the iteration.
+ */
+static inline void metrics_begin_iteration() {
+    if (metrics_file == nullptr) {
+        return;
+    }
+
+    set_phase(algorithm_phase(current_phase));
+    std::copy(phase_seconds, phase_seconds + NUM_PHASES, metrics_phase_seconds);
+    metrics_communication_seconds = communication_seconds;
+    metrics_io_seconds = io_seconds;
+    metrics_iteration_start = std::chrono::high_resolution_clock::now();
+}
+
+static inline void metrics_end_iteration(
+    int iteration,
+    double num_elements,
+    const iteration_metrics& metrics) {
+    if (metrics_file == nullptr) {
+        return;
+    }
+
+    set_phase(algorithm_phase(current_phase));
+    auto now = std::chrono::high_resolution_clock::now();
+
+    fprintf(
+        metrics_file,
+        "{\"type\": \"iteration\", \"iteration\": %d, \"seconds\": %g",
+        iteration,
+        std::chrono::duration<double>(now - metrics_iteration_start).count());
+
+    for (int i = 0; i < NUM_PHASES; i++) {
+        fprintf(
+            metrics_file,
+            ", \"%s_seconds\": %g",
+            phase_names[i],
+            phase_seconds[i] - metrics_phase_seconds[i]);
+    }
+
+    fprintf(
+        metrics_file,
+        ", \"communication_seconds\": %g, \"io_seconds\": %g"
+        ", \"rows_updated\": %d, \"cols_updated\": %d"
+        ", \"objective\": %.17g, \"average_error\": %.17g"
+        ", \"distance_evaluations\": %.0f}\n",
+        communication_seconds - metrics_communication_seconds,
+        io_seconds - metrics_io_seconds,
+        metrics.rows_updated,
+        metrics.cols_updated,
+        metrics.objective,
+        metrics.objective / num_elements,
+        metrics.distance_evaluations);
+    fflush(metrics_file);
+    metrics_iterations = iteration;
+}
+
+/**
+ * Write the summary of the run, with the totals over all iterations and the
+ * time spent reading the input and writing the output, and close the file.
+ */
+static inline void metrics_close(double total_seconds) {
+    if (metrics_file == nullptr) {
+        return;
+    }
+
+    set_phase(algorithm_phase(current_phase));
+    fprintf(
+        metrics_file,
+        "{\"type\": \"summary\", \"iterations\": %d, \"seconds\": %g",
+        metrics_iterations,
+        total_seconds);
+
+    for (int i = 0; i < NUM_PHASES; i++) {
+        fprintf(metrics_file, ", \"%s_seconds\": %g", phase_names[i], phase_seconds[i]);
+    }
+
+    fprintf(
+        metrics_file,
+        ", \"communication_seconds\": %g, \"io_seconds\": %g}\n",
+        communication_seconds,
+        io_seconds);
+    fclose(metrics_file);
+    metrics_file = nullptr;
+}
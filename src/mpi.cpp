@@ -1,8 +1,14 @@
 #include <chrono>
 #include <iostream>
+#include <sstream>
 
 #include "common.h"
+#include "memory.h"
+#include "metrics.h"
+#include "mpi_profile.h"
+#include "timing.h"
 #include <mpi.h>
+#include <omp.h>
 
 std::pair<std::vector<int>, std::vector<int>> calculate_scatter(int n, int size) {
     int count = n / size;
@@ -25,59 +31,299 @@ std::pair<std::vector<int>, std::vector<int>> calculate_scatter(int n, int size)
 }
 
 /**
- * This function returns a matrix of size (num_row_labels, num_col_labels)
- * that stores the average value for each combination of row label and
- * column label. In other words, the entry at coordinate (x, y) is the
- * average over all input values having row label x and column label y.
+ * Repartition `n` items over the ranks based on the measured speed of each
+ * rank: `seconds` is the time this rank spent on its `counts[rank]` items
+ * during the last iteration. Each rank gets a share of the items proportional
+ * to its throughput (items per second). Nothing changes if the slowest rank
+ * is within `threshold` of the average time. Returns true if `counts` and
+ * `displacements` were updated.
+ */
+bool rebalance_scatter(
+    int n,
+    double seconds,
+    std::vector<int>* counts,
+    std::vector<int>* displacements,
+    MPI_Comm comm,
+    double threshold = 0.05) {
+    int size = int(counts->size());
+    auto times = std::vector<double>(size);
+    MPI_Allgather(&seconds, 1, MPI_DOUBLE, times.data(), 1, MPI_DOUBLE, comm);
+
+    double total_time = 0, max_time = 0;
+    for (int i = 0; i < size; i++) {
+        total_time += times[i];
+        max_time = std::max(max_time, times[i]);
+    }
+
+    if (total_time <= 0 || max_time <= (1.0 + threshold) * total_time / size) {
+        return false;
+    }
+
+    // Ranks without items or without a measurable time get the average rate
+    double average_rate = n / total_time;
+    auto rates = std::vector<double>(size);
+    double total_rate = 0;
+
+    for (int i = 0; i < size; i++) {
+        bool measured = (*counts)[i] > 0 && times[i] > 0;
+        rates[i] = measured ? (*counts)[i] / times[i] : average_rate;
+        total_rate += rates[i];
+    }
+
+    // Move halfway towards the target to avoid oscillation due to noise.
+    // Items that are lost to rounding go to the ranks with the largest
+    // remainders.
+    auto target = std::vector<double>(size);
+    auto new_counts = std::vector<int>(size);
+    int assigned = 0;
+
+    for (int i = 0; i < size; i++) {
+        target[i] = 0.5 * ((*counts)[i] + n * rates[i] / total_rate);
+        new_counts[i] = int(target[i]);
+        assigned += new_counts[i];
+    }
+
+    auto order = std::vector<int>(size);
+    for (int i = 0; i < size; i++) {
+        order[i] = i;
+    }
+
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+        return target[a] - new_counts[a] > target[b] - new_counts[b];
+    });
+
+    for (int i = 0; assigned < n; i = (i + 1) % size) {
+        new_counts[order[i]]++;
+        assigned++;
+    }
+
+    if (new_counts == *counts) {
+        return false;
+    }
+
+    *counts = new_counts;
+
+    for (int i = 0, offset = 0; i < size; i++) {
+        (*displacements)[i] = offset;
+        offset += new_counts[i];
+    }
+
+    return true;
+}
+
+/**
+ * Returns the partial sums of the calling thread of a parallel region: the
+ * first thread uses `values` itself, and every other thread its own slice of
+ * `num_values` in `thread_values`, which is set to zero. The slices are too
+ * large to be privatized by an OpenMP reduction, which puts them on the
+ * stack of every thread.
+ */
+template<typename V>
+V* begin_thread_values(size_t num_values, V* values, V* thread_values) {
+    int thread = omp_get_thread_num();
+
+    if (thread == 0) {
+        return values;
+    }
+
+    V* slice = &thread_values[(thread - 1) * num_values];
+    std::fill(slice, slice + num_values, V(0));
+    return slice;
+}
+
+/**
+ * Add the slices of `begin_thread_values` to `values`. This must be called
+ * by all threads of the parallel region, which split the values between
+ * them.
+ */
+template<typename V>
+void end_thread_values(size_t num_values, V* values, const V* thread_values) {
+    int num_threads = omp_get_num_threads();
+
+#pragma omp barrier
+#pragma omp for schedule(static)
+    for (size_t n = 0; n < num_values; n++) {
+        V sum = values[n];
+
+        for (int thread = 1; thread < num_threads; thread++) {
+            sum += thread_values[(thread - 1) * num_values + n];
+        }
+
+        values[n] = sum;
+    }
+}
+
+/**
+ * Add the values of a block of the matrix to the per-cluster sums and sizes.
+ * The block has `num_rows` rows and `num_cols` columns, consecutive rows are
+ * `stride` elements apart, and `row_labels`/`col_labels` hold the labels of
+ * the rows and columns of the block. Every thread but the first accumulates
+ * into its own slice of `thread_cluster_sum` and `thread_cluster_size`, see
+ * `begin_thread_values`.
  */
-std::vector<float> calculate_cluster_average(
+template<typename T>
+void accumulate_cluster_sum(
     int num_rows,
     int num_cols,
+    int stride,
     int num_row_labels,
     int num_col_labels,
-    const float* matrix,
+    const T* matrix,
     const label_type* row_labels,
     const label_type* col_labels,
-    int row_displacement) {
+    double* cluster_sum,
+    index_type* cluster_size,
+    double* thread_cluster_sum,
+    index_type* thread_cluster_size) {
+    size_t num_clusters = size_t(num_row_labels) * num_col_labels;
+
+#pragma omp parallel
+    {
+        TRACE_SCOPE("accumulate_cluster_sum", "thread");
+        double* sum = begin_thread_values(num_clusters, cluster_sum, thread_cluster_sum);
+        index_type* size = begin_thread_values(num_clusters, cluster_size, thread_cluster_size);
+
+#pragma omp for collapse(2) nowait
+        for (int i = 0; i < num_rows; i++) {
+            for (int j = 0; j < num_cols; j++) {
+                float item = matrix[index_type(i) * stride + j];
+                auto row_label = row_labels[i];
+                auto col_label = col_labels[j];
 
-    int num_clusters = num_row_labels * num_col_labels;
-    auto local_cluster_sum =
-        std::vector<double>(num_clusters, 0.0);
-    auto local_cluster_size = std::vector<int>(num_clusters, 0);
-
-    for (int i = row_displacement; i < num_rows + row_displacement; i++) {
-        for (int j = 0; j < num_cols; j++) {
-            auto item = matrix[i * num_cols + j];
-            auto row_label = row_labels[i];
-            auto col_label = col_labels[j];
-
-            local_cluster_sum[row_label * num_col_labels + col_label] += item;
-            local_cluster_size[row_label * num_col_labels + col_label] += 1;
+                sum[row_label * num_col_labels + col_label] += item;
+                size[row_label * num_col_labels + col_label] += 1;
+            }
         }
+
+        end_thread_values(num_clusters, cluster_sum, thread_cluster_sum);
+        end_thread_values(num_clusters, cluster_size, thread_cluster_size);
     }
+}
 
-    auto cluster_sum =
-        std::vector<double>(num_clusters, 0.0);
-    auto cluster_size = std::vector<int>(num_clusters, 0);
+/**
+ * Communicators for the two-level reduction of the cluster statistics:
+ * `node` contains the ranks of `comm` sharing a node and `leaders` contains
+ * the first rank of every node. `leaders` is MPI_COMM_NULL on the other ranks.
+ */
+struct reduction_comms {
+    MPI_Comm node;
+    MPI_Comm leaders;
+};
+
+reduction_comms create_reduction_comms(MPI_Comm comm) {
+    int rank;
+    MPI_Comm_rank(comm, &rank);
+
+    reduction_comms comms;
+    MPI_Comm_split_type(
+        comm,
+        MPI_COMM_TYPE_SHARED,
+        rank,
+        MPI_INFO_NULL,
+        &comms.node);
+
+    int node_rank;
+    MPI_Comm_rank(comms.node, &node_rank);
+    MPI_Comm_split(
+        comm,
+        node_rank == 0 ? 0 : MPI_UNDEFINED,
+        rank,
+        &comms.leaders);
+
+    return comms;
+}
 
-    for (int i = 0; i < cluster_sum.size(); i++) {
-        MPI_Allreduce(
-            local_cluster_sum.data(),
-            cluster_sum.data(),
-            cluster_sum.size(),
+void free_reduction_comms(reduction_comms* comms) {
+    if (comms->leaders != MPI_COMM_NULL) {
+        MPI_Comm_free(&comms->leaders);
+    }
+
+    MPI_Comm_free(&comms->node);
+}
+
+/**
+ * Sum `cluster_sum` and `cluster_size` over all ranks in place. The values
+ * are first reduced within each node, then between the node leaders, and
+ * finally broadcast within each node. This way, only one rank per node
+ * communicates over the network.
+ */
+void reduce_cluster_sums(
+    int num_clusters,
+    double* cluster_sum,
+    index_type* cluster_size,
+    const reduction_comms& comms) {
+    int node_rank;
+    MPI_Comm_rank(comms.node, &node_rank);
+    MPI_Request requests[2];
+
+    // Reduce within the node onto the leader
+    MPI_Ireduce(
+        node_rank == 0 ? MPI_IN_PLACE : cluster_sum,
+        cluster_sum,
+        num_clusters,
+        MPI_DOUBLE,
+        MPI_SUM,
+        0,
+        comms.node,
+        &requests[0]);
+    MPI_Ireduce(
+        node_rank == 0 ? MPI_IN_PLACE : cluster_size,
+        cluster_size,
+        num_clusters,
+        MPI_INT64_T,
+        MPI_SUM,
+        0,
+        comms.node,
+        &requests[1]);
+    MPI_Waitall(2, requests, MPI_STATUSES_IGNORE);
+
+    // Reduce between the nodes
+    if (comms.leaders != MPI_COMM_NULL) {
+        MPI_Iallreduce(
+            MPI_IN_PLACE,
+            cluster_sum,
+            num_clusters,
             MPI_DOUBLE,
             MPI_SUM,
-            MPI_COMM_WORLD);
-        MPI_Allreduce(
-            local_cluster_size.data(),
-            cluster_size.data(),
-            cluster_size.size(),
-            MPI_INT,
+            comms.leaders,
+            &requests[0]);
+        MPI_Iallreduce(
+            MPI_IN_PLACE,
+            cluster_size,
+            num_clusters,
+            MPI_INT64_T,
             MPI_SUM,
-            MPI_COMM_WORLD);
+            comms.leaders,
+            &requests[1]);
+        MPI_Waitall(2, requests, MPI_STATUSES_IGNORE);
     }
 
-    auto cluster_avg = std::vector<float>(num_clusters);
+    // Broadcast the result within the node
+    MPI_Ibcast(cluster_sum, num_clusters, MPI_DOUBLE, 0, comms.node, &requests[0]);
+    MPI_Ibcast(cluster_size, num_clusters, MPI_INT64_T, 0, comms.node, &requests[1]);
+    MPI_Waitall(2, requests, MPI_STATUSES_IGNORE);
+}
+
+/**
+ * This function calculates a matrix of size (num_row_labels, num_col_labels)
+ * that stores the average value for each combination of row label and
+ * column label. In other words, the entry at coordinate (x, y) is the
+ * average over all input values having row label x and column label y.
+ * The result is stored in `cluster_avg`.
+ *
+ * The local `cluster_sum` and `cluster_size` of each rank are reduced in
+ * place, so on return they hold the global sums and sizes.
+ */
+void calculate_cluster_average(
+    int num_row_labels,
+    int num_col_labels,
+    double* cluster_sum,
+    index_type* cluster_size,
+    float* cluster_avg,
+    const reduction_comms& comms) {
+    int num_clusters = num_row_labels * num_col_labels;
+
+    reduce_cluster_sums(num_clusters, cluster_sum, cluster_size, comms);
 
     for (int i = 0; i < num_row_labels; i++) {
         for (int j = 0; j < num_col_labels; j++) {
@@ -86,8 +332,6 @@ std::vector<float> calculate_cluster_average(
                 float(cluster_sum[index]) / float(cluster_size[index]);
         }
     }
-
-    return cluster_avg;
 }
 
 float calculate_distance(float avg, float item) {
@@ -99,100 +343,244 @@ float calculate_distance(float avg, float item) {
  * Update the labels along the rows of the matrix. This function returns
  * both the number of rows that changed their label and the total distance.
  * If the first return value is zero, then no row was updated.
+ *
+ * Every thread processes blocks of rows, with the row labels in tiles: for
+ * every block of columns, the averages of the tile are gathered into `panel`,
+ * which stays in cache while it is applied to all rows of the block. The
+ * best label of every row is carried over from one tile to the next.
  */
+template<typename T>
 std::pair<int, double> update_row_labels(
     int num_rows,
     int num_cols,
     int num_row_labels,
     int num_col_labels,
-    const float* matrix,
+    const T* matrix,
     label_type* row_labels,
     const label_type* col_labels,
     const float* cluster_avg,
     int displacement) {
+    const int block_rows = 16;
+    const int block_cols = 256;
+    const int tile_labels = 32;
+    int num_blocks = (num_rows + block_rows - 1) / block_rows;
     int num_updated = 0;
     double total_dist = 0;
 
-    for (int i = 0; i < num_rows; i++) {
-        int best_label = -1;
-        double best_dist = INFINITY;
-        int displaced_i = i + displacement;
-
-        for (int k = 0; k < num_row_labels; k++) {
-            double dist = 0;
-
-            for (int j = 0; j < num_cols; j++) {
-                float item = matrix[displaced_i * num_cols + j];
-
-                int row_label = k;
-                int col_label = col_labels[j];
-                float y = cluster_avg[row_label * num_col_labels + col_label];
-
-                dist += calculate_distance(y, item);
+#pragma omp parallel
+    {
+        TRACE_SCOPE("update_row_labels", "thread");
+        float panel[block_cols * tile_labels];
+        double dist[block_rows * tile_labels];
+        double best_dist[block_rows];
+        int best_label[block_rows];
+
+#pragma omp for schedule(dynamic) nowait reduction(+ : num_updated, total_dist)
+        for (int block = 0; block < num_blocks; block++) {
+            int row_begin = block * block_rows;
+            int num_block_rows = std::min(block_rows, num_rows - row_begin);
+
+            std::fill(best_dist, best_dist + num_block_rows, INFINITY);
+            std::fill(best_label, best_label + num_block_rows, -1);
+
+            for (int label_begin = 0; label_begin < num_row_labels; label_begin += tile_labels) {
+                int num_tile_labels = std::min(tile_labels, num_row_labels - label_begin);
+
+                std::fill(dist, dist + num_block_rows * tile_labels, 0.0);
+
+                for (int col_begin = 0; col_begin < num_cols; col_begin += block_cols) {
+                    int num_block_cols = std::min(block_cols, num_cols - col_begin);
+
+                    // panel[j, k] = cluster_avg[label_begin + k, col_labels[col_begin + j]]
+                    for (int j = 0; j < num_block_cols; j++) {
+                        const float* avg =
+                            &cluster_avg[label_begin * num_col_labels + col_labels[col_begin + j]];
+
+                        for (int k = 0; k < num_tile_labels; k++) {
+                            panel[j * tile_labels + k] = avg[k * num_col_labels];
+                        }
+                    }
+
+                    for (int i = 0; i < num_block_rows; i++) {
+                        index_type displaced_i = displacement + row_begin + i;
+                        const T* row = &matrix[displaced_i * num_cols + col_begin];
+                        double* row_dist = &dist[i * tile_labels];
+
+                        for (int j = 0; j < num_block_cols; j++) {
+                            float item = row[j];
+                            const float* y = &panel[j * tile_labels];
+
+                            for (int k = 0; k < num_tile_labels; k++) {
+                                row_dist[k] += calculate_distance(y[k], item);
+                            }
+                        }
+                    }
+                }
+
+                for (int i = 0; i < num_block_rows; i++) {
+                    for (int k = 0; k < num_tile_labels; k++) {
+                        if (dist[i * tile_labels + k] < best_dist[i]) {
+                            best_dist[i] = dist[i * tile_labels + k];
+                            best_label[i] = label_begin + k;
+                        }
+                    }
+                }
             }
 
-            if (dist < best_dist) {
-                best_dist = dist;
-                best_label = k;
-            }
-        }
+            for (int i = 0; i < num_block_rows; i++) {
+                if (row_labels[row_begin + i] != best_label[i]) {
+                    row_labels[row_begin + i] = best_label[i];
+                    num_updated++;
+                }
 
-        if (row_labels[i] != best_label) {
-            row_labels[i] = best_label;
-            num_updated++;
+                total_dist += best_dist[i];
+            }
         }
-
-        total_dist += best_dist;
     }
 
     return {num_updated, total_dist};
 }
 
 /**
- * Update the labels along the columns of the matrix. This function returns
- * the number of columns that changed their label label and the total distance.
- * If the first return value is zero, then no column was updated.
+ * Add the contribution of a block of rows to the distance between each
+ * column of the block and each column label. `col_dist` has size
+ * (num_cols, num_col_labels). The matrix is traversed row by row, which
+ * allows a rank to start on the rows whose labels it already knows before
+ * the labels of the other ranks have arrived.
  */
-std::pair<int, double> update_col_labels(
+template<typename T>
+void accumulate_col_distances(
     int num_rows,
     int num_cols,
+    int stride,
     int num_col_labels,
-    const float* matrix,
+    const T* matrix,
     const label_type* row_labels,
-    label_type* col_labels,
     const float* cluster_avg,
-    int displacement,
-    int num_cols_recv) {
-    int num_updated = 0;
-    double total_dist = 0;
-
-    for (int j = 0; j < num_cols_recv; j++) {
-        int best_label = -1;
-        double best_dist = INFINITY;
-
-        int displaced_j = j + displacement;
+    double* col_dist) {
+    // Each thread processes a block of columns for all rows, so that the
+    // distances of a column are only updated by a single thread. The column
+    // labels are processed in tiles, so that the distances and averages of
+    // a tile stay in cache while the rows of the block are read.
+    const int block_size = 256;
+    const int tile_labels = 32;
+    int num_blocks = (num_cols + block_size - 1) / block_size;
+
+#pragma omp parallel
+    {
+        TRACE_SCOPE("accumulate_col_distances", "thread");
+
+#pragma omp for schedule(static) nowait
+        for (int block = 0; block < num_blocks; block++) {
+            int col_begin = block * block_size;
+            int col_end = std::min(col_begin + block_size, num_cols);
+
+            for (int label_begin = 0; label_begin < num_col_labels; label_begin += tile_labels) {
+                int label_end = std::min(label_begin + tile_labels, num_col_labels);
+
+                for (int i = 0; i < num_rows; i++) {
+                    const float* avg = &cluster_avg[row_labels[i] * num_col_labels];
+
+                    for (int j = col_begin; j < col_end; j++) {
+                        float item = matrix[index_type(i) * stride + j];
+                        double* dist = &col_dist[index_type(j) * num_col_labels];
+
+                        for (int k = label_begin; k < label_end; k++) {
+                            dist[k] += calculate_distance(avg[k], item);
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
 
-        for (int k = 0; k < num_col_labels; k++) {
-            double dist = 0;
+/**
+ * Add the contribution of a block of columns to the distance between each
+ * row and each row label. `row_dist` has size (num_rows, num_row_labels).
+ * The threads split the columns of every row, which keeps them busy when
+ * there are fewer rows than threads. The block has `num_cols` columns,
+ * consecutive rows are `stride` elements apart, and `col_labels` holds the
+ * labels of the columns of the block. Every thread but the first accumulates
+ * into its own slice of `thread_row_dist`, see `begin_thread_values`.
+ */
+template<typename T>
+void accumulate_row_distances(
+    int num_rows,
+    int num_cols,
+    int stride,
+    int num_row_labels,
+    int num_col_labels,
+    const T* matrix,
+    const label_type* col_labels,
+    const float* cluster_avg,
+    double* row_dist,
+    double* thread_row_dist) {
+    const int block_size = 4096;
+    int num_blocks = (num_cols + block_size - 1) / block_size;
+    size_t num_dists = size_t(num_rows) * num_row_labels;
+
+#pragma omp parallel
+    {
+        TRACE_SCOPE("accumulate_row_distances", "thread");
+        double* dists = begin_thread_values(num_dists, row_dist, thread_row_dist);
+
+#pragma omp for schedule(static) nowait
+        for (int block = 0; block < num_blocks; block++) {
+            int col_begin = block * block_size;
+            int col_end = std::min(col_begin + block_size, num_cols);
 
             for (int i = 0; i < num_rows; i++) {
-                auto item = matrix[i * num_cols + displaced_j];
+                const T* row = &matrix[index_type(i) * stride];
 
-                auto row_label = row_labels[i];
-                auto col_label = k;
-                auto y = cluster_avg[row_label * num_col_labels + col_label];
+                for (int k = 0; k < num_row_labels; k++) {
+                    const float* avg = &cluster_avg[k * num_col_labels];
+                    double dist = 0;
 
-                dist += calculate_distance(y, item);
+                    for (int j = col_begin; j < col_end; j++) {
+                        dist += calculate_distance(avg[col_labels[j]], float(row[j]));
+                    }
+
+                    dists[i * num_row_labels + k] += dist;
+                }
             }
+        }
+
+        end_thread_values(num_dists, row_dist, thread_row_dist);
+    }
+}
+
+/**
+ * Update the labels of `num_items` rows or columns given their distance to
+ * each of the `num_labels` labels, as calculated by `accumulate_col_distances`
+ * or `accumulate_row_distances`. This function returns the number of items
+ * that changed their label and the total distance. If the first return value
+ * is zero, then no item was updated.
+ */
+std::pair<int, double> update_labels(
+    int num_items,
+    int num_labels,
+    label_type* labels,
+    const double* dist) {
+    int num_updated = 0;
+    double total_dist = 0;
+
+#pragma omp parallel for reduction(+ : num_updated, total_dist)
+    for (int j = 0; j < num_items; j++) {
+        int best_label = -1;
+        double best_dist = INFINITY;
 
-            if (dist < best_dist) {
-                best_dist = dist;
+        for (int k = 0; k < num_labels; k++) {
+            double item_dist = dist[index_type(j) * num_labels + k];
+
+            if (item_dist < best_dist) {
+                best_dist = item_dist;
                 best_label = k;
             }
         }
 
-        if (col_labels[j] != best_label) {
-            col_labels[j] = best_label;
+        if (labels[j] != best_label) {
+            labels[j] = best_label;
             num_updated++;
         }
 
@@ -202,139 +590,522 @@ std::pair<int, double> update_col_labels(
     return {num_updated, total_dist};
 }
 
+/**
+ * The buffers of an iteration. They are allocated once per run, so that the
+ * iterations themselves do not allocate memory. The label and distance
+ * buffers hold the rows and columns of this rank, see `resize_workspace`.
+ * The `thread_*` buffers hold the partial sums of all threads but the first.
+ */
+struct iteration_workspace {
+    tracked_vector<double, MEMORY_CLUSTERS> cluster_sum;
+    tracked_vector<index_type, MEMORY_CLUSTERS> cluster_size;
+    tracked_vector<double, MEMORY_CLUSTERS> thread_cluster_sum;
+    tracked_vector<index_type, MEMORY_CLUSTERS> thread_cluster_size;
+    tracked_vector<float, MEMORY_CLUSTERS> cluster_avg;
+    tracked_vector<label_type, MEMORY_LABELS> scatter_row_labels;
+    tracked_vector<label_type, MEMORY_LABELS> scatter_col_labels;
+    tracked_vector<double, MEMORY_DISTANCES> col_dist;
+    tracked_vector<double, MEMORY_DISTANCES> row_dist;
+    tracked_vector<double, MEMORY_DISTANCES> thread_row_dist;
+};
+
+/**
+ * Estimate the memory of the buffers of `resize_workspace` besides the
+ * cluster statistics, which `estimate_buffer_bytes` includes, for a rank of
+ * `num_ranks` that holds an equal share of the rows and columns and runs
+ * `num_threads` threads.
+ */
+double estimate_workspace_bytes(
+    int num_rows,
+    int num_cols,
+    int num_row_labels,
+    int num_col_labels,
+    int num_ranks,
+    int num_threads,
+    bool split_rows) {
+    double row_dist_bytes = split_rows ? double(num_rows) * num_row_labels * sizeof(double) : 0;
+    double thread_bytes = double(num_row_labels) * num_col_labels
+            * (sizeof(double) + sizeof(index_type))
+        + row_dist_bytes;
+
+    return (double(num_rows) + num_cols) / num_ranks * sizeof(label_type)
+        + double(num_cols) / num_ranks * num_col_labels * sizeof(double)
+        + row_dist_bytes
+        + (num_threads - 1) * thread_bytes;
+}
+
+/**
+ * Size the buffers of `workspace` for `num_rows_recv` rows and
+ * `num_cols_recv` columns on this rank. The distances of all `num_rows` rows
+ * are only needed if `split_rows` is set. Memory is only allocated if the
+ * buffers grow, which only happens after a repartition.
+ */
+void resize_workspace(
+    iteration_workspace* workspace,
+    int num_rows,
+    int num_row_labels,
+    int num_col_labels,
+    int num_rows_recv,
+    int num_cols_recv,
+    bool split_rows) {
+    size_t num_clusters = size_t(num_row_labels) * num_col_labels;
+    size_t num_dists = split_rows ? size_t(num_rows) * num_row_labels : 0;
+    int num_threads = omp_get_max_threads();
+
+    workspace->cluster_sum.resize(num_clusters);
+    workspace->cluster_size.resize(num_clusters);
+    workspace->thread_cluster_sum.resize((num_threads - 1) * num_clusters);
+    workspace->thread_cluster_size.resize((num_threads - 1) * num_clusters);
+    workspace->cluster_avg.resize(num_clusters);
+    workspace->scatter_row_labels.resize(num_rows_recv);
+    workspace->scatter_col_labels.resize(num_cols_recv);
+    workspace->col_dist.resize(size_t(num_cols_recv) * num_col_labels);
+    workspace->row_dist.resize(num_dists);
+    workspace->thread_row_dist.resize((num_threads - 1) * num_dists);
+}
+
 /**
  * Perform one iteration of the co-clustering algorithm. This function updates
  * the labels in both `row_labels` and `col_labels`, and returns the total
  * number of labels that changed (i.e., the number of rows and columns that
- * were reassigned to a different label).
+ * were reassigned to a different label). The number of updates per axis and
+ * the work done by all ranks are stored in `metrics`.
+ *
+ * On entry, `cluster_sum` and `cluster_size` of `workspace` hold the local
+ * cluster sums of this rank for the current labels. On return, they hold the
+ * local cluster sums for the updated labels, ready for the next iteration.
+ * This allows the accumulation to overlap with the exchange of the column
+ * labels. The other buffers are also taken from `workspace`, so no memory is
+ * allocated.
  */
+template<typename T>
 std::pair<int, double> cluster_serial_iteration(
     int num_rows,
     int num_cols,
     int num_row_labels,
     int num_col_labels,
-    const float* matrix,
+    const T* matrix,
     label_type* row_labels,
     label_type* col_labels,
+    iteration_workspace* workspace,
+    MPI_Comm comm,
+    const reduction_comms& comms,
     int rank,
     const int* row_counts,
     const int* row_displacements,
     const int* col_counts,
-    const int* col_displacements) {
-
+    const int* col_displacements,
+    double* row_seconds,
+    double* col_seconds,
+    iteration_metrics* metrics) {
+    int num_clusters = num_row_labels * num_col_labels;
     int num_rows_recv = row_counts[rank];
     int row_displacement = row_displacements[rank];
+    int num_cols_recv = col_counts[rank];
+    int col_displacement = col_displacements[rank];
+    double* cluster_sum = workspace->cluster_sum.data();
+    index_type* cluster_size = workspace->cluster_size.data();
+    double* thread_cluster_sum = workspace->thread_cluster_sum.data();
+    index_type* thread_cluster_size = workspace->thread_cluster_size.data();
+    float* cluster_avg = workspace->cluster_avg.data();
+    label_type* scatter_row_labels = workspace->scatter_row_labels.data();
+    label_type* scatter_col_labels = workspace->scatter_col_labels.data();
+    double* col_dist = workspace->col_dist.data();
+    MPI_Request requests[3];
+    double start;
 
     //// SECTION: calculate_cluster_average
+    set_phase(PHASE_CLUSTER_AVERAGE);
+
     // Calculate the average value per cluster
-    auto cluster_avg = calculate_cluster_average(
-        num_rows_recv,
-        num_cols,
+    calculate_cluster_average(
         num_row_labels,
         num_col_labels,
-        matrix,
-        row_labels,
-        col_labels,
-        row_displacement);
+        cluster_sum,
+        cluster_size,
+        cluster_avg,
+        comms);
 
     //// SECTION: update_row_labels
-    auto scatter_row_labels = std::vector<label_type>(num_rows_recv, 0);
-    MPI_Scatterv(row_labels,
-                row_counts,
-                row_displacements,
-                MPI_INT,
-                scatter_row_labels.data(),
-                num_rows_recv,
-                MPI_INT,
-                0,
-                MPI_COMM_WORLD);
+    set_phase(PHASE_ROW_UPDATE);
+
+    // Every rank holds all labels, so the labels of this rank are copied
+    // locally instead of being scattered from rank 0.
+    std::copy(
+        row_labels + row_displacement,
+        row_labels + row_displacement + num_rows_recv,
+        scatter_row_labels);
 
     // Update labels along the rows
+    start = MPI_Wtime();
     auto [num_rows_updated, _] = update_row_labels(
         num_rows_recv,
         num_cols,
         num_row_labels,
         num_col_labels,
         matrix,
-        scatter_row_labels.data(),
+        scatter_row_labels,
         col_labels,
-        cluster_avg.data(),
+        cluster_avg,
         row_displacement);
-
-    // Synchronize row_labels and num_rows_updated
-    MPI_Allgatherv(scatter_row_labels.data(),
-                   num_rows_recv,
-                   MPI_INT,
-                   row_labels,
-                   row_counts,
-                   row_displacements,
-                   MPI_INT,
-                   MPI_COMM_WORLD);
-    MPI_Allreduce(&num_rows_updated, &num_rows_updated, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+    *row_seconds = MPI_Wtime() - start;
+
+    // Start synchronizing row_labels and num_rows_updated
+    MPI_Iallgatherv(scatter_row_labels,
+                    num_rows_recv,
+                    MPI_INT,
+                    row_labels,
+                    row_counts,
+                    row_displacements,
+                    MPI_INT,
+                    comm,
+                    &requests[0]);
+    MPI_Iallreduce(MPI_IN_PLACE, &num_rows_updated, 1, MPI_INT, MPI_SUM, comm, &requests[1]);
 
     //// SECTION: update_col_labels
-    int num_cols_recv = col_counts[rank];
-    auto scatter_col_labels = std::vector<label_type>(num_cols_recv, 0);
-    MPI_Scatterv(col_labels,
-                col_counts,
-                col_displacements,
-                MPI_INT,
-                scatter_col_labels.data(),
-                num_cols_recv,
-                MPI_INT,
-                0,
-                MPI_COMM_WORLD);
+    set_phase(PHASE_COL_UPDATE);
 
-    int col_displacement = col_displacements[rank];
+    std::copy(
+        col_labels + col_displacement,
+        col_labels + col_displacement + num_cols_recv,
+        scatter_col_labels);
+    std::fill(col_dist, col_dist + size_t(num_cols_recv) * num_col_labels, 0.0);
+
+    // While the row labels are in flight, process the rows of this rank
+    start = MPI_Wtime();
+    accumulate_col_distances(
+        num_rows_recv,
+        num_cols_recv,
+        num_cols,
+        num_col_labels,
+        matrix + index_type(row_displacement) * num_cols + col_displacement,
+        scatter_row_labels,
+        cluster_avg,
+        col_dist);
+    *col_seconds = MPI_Wtime() - start;
+
+    MPI_Waitall(2, requests, MPI_STATUSES_IGNORE);
+
+    // Process the rows before and after the rows of this rank
+    start = MPI_Wtime();
+    accumulate_col_distances(
+        row_displacement,
+        num_cols_recv,
+        num_cols,
+        num_col_labels,
+        matrix + col_displacement,
+        row_labels,
+        cluster_avg,
+        col_dist);
+
+    int row_end = row_displacement + num_rows_recv;
+    accumulate_col_distances(
+        num_rows - row_end,
+        num_cols_recv,
+        num_cols,
+        num_col_labels,
+        matrix + index_type(row_end) * num_cols + col_displacement,
+        row_labels + row_end,
+        cluster_avg,
+        col_dist);
 
     // Update the labels along the columns
-    auto [num_cols_updated, total_dist] = update_col_labels(
+    auto [num_cols_updated, total_dist] = update_labels(
+        num_cols_recv,
+        num_col_labels,
+        scatter_col_labels,
+        col_dist);
+    *col_seconds += MPI_Wtime() - start;
+
+    // Start synchronizing col_labels, num_cols_updated and total_dist
+    MPI_Iallgatherv(scatter_col_labels,
+                    num_cols_recv,
+                    MPI_INT,
+                    col_labels,
+                    col_counts,
+                    col_displacements,
+                    MPI_INT,
+                    comm,
+                    &requests[0]);
+    MPI_Iallreduce(MPI_IN_PLACE, &num_cols_updated, 1, MPI_INT, MPI_SUM, comm, &requests[1]);
+    MPI_Iallreduce(MPI_IN_PLACE, &total_dist, 1, MPI_DOUBLE, MPI_SUM, comm, &requests[2]);
+
+    //// SECTION: accumulate cluster sums for the next iteration
+    set_phase(PHASE_CLUSTER_AVERAGE);
+
+    std::fill(cluster_sum, cluster_sum + num_clusters, 0.0);
+    std::fill(cluster_size, cluster_size + num_clusters, 0);
+
+    // While the column labels are in flight, process the columns of this rank
+    start = MPI_Wtime();
+    accumulate_cluster_sum(
+        num_rows_recv,
+        num_cols_recv,
+        num_cols,
+        num_row_labels,
+        num_col_labels,
+        matrix + index_type(row_displacement) * num_cols + col_displacement,
+        scatter_row_labels,
+        scatter_col_labels,
+        cluster_sum,
+        cluster_size,
+        thread_cluster_sum,
+        thread_cluster_size);
+    *row_seconds += MPI_Wtime() - start;
+
+    MPI_Waitall(3, requests, MPI_STATUSES_IGNORE);
+
+    // Process the columns before and after the columns of this rank
+    start = MPI_Wtime();
+    accumulate_cluster_sum(
+        num_rows_recv,
+        col_displacement,
+        num_cols,
+        num_row_labels,
+        num_col_labels,
+        matrix + index_type(row_displacement) * num_cols,
+        scatter_row_labels,
+        col_labels,
+        cluster_sum,
+        cluster_size,
+        thread_cluster_sum,
+        thread_cluster_size);
+
+    int col_end = col_displacement + num_cols_recv;
+    accumulate_cluster_sum(
+        num_rows_recv,
+        num_cols - col_end,
+        num_cols,
+        num_row_labels,
+        num_col_labels,
+        matrix + index_type(row_displacement) * num_cols + col_end,
+        scatter_row_labels,
+        col_labels + col_end,
+        cluster_sum,
+        cluster_size,
+        thread_cluster_sum,
+        thread_cluster_size);
+    *row_seconds += MPI_Wtime() - start;
+
+    set_phase(PHASE_OTHER);
+    metrics->rows_updated = num_rows_updated;
+    metrics->cols_updated = num_cols_updated;
+    metrics->objective = total_dist;
+    metrics->distance_evaluations =
+        double(num_rows) * num_cols * (num_row_labels + num_col_labels);
+
+    return {num_rows_updated + num_cols_updated, total_dist};
+}
+
+/**
+ * Perform one iteration of the co-clustering algorithm like
+ * `cluster_serial_iteration`, but with all work partitioned by column: for
+ * the row update, every rank calculates the distances of all rows over its
+ * own columns, and these partial distances are summed over the ranks. This
+ * keeps all ranks and threads busy on matrices with few rows, where
+ * partitioning the rows would leave most of them idle. Every rank then
+ * updates all row labels itself, so the row labels need not be exchanged.
+ */
+template<typename T>
+std::pair<int, double> cluster_split_rows_iteration(
+    int num_rows,
+    int num_cols,
+    int num_row_labels,
+    int num_col_labels,
+    const T* matrix,
+    label_type* row_labels,
+    label_type* col_labels,
+    iteration_workspace* workspace,
+    MPI_Comm comm,
+    const reduction_comms& comms,
+    int rank,
+    const int* col_counts,
+    const int* col_displacements,
+    double* seconds,
+    iteration_metrics* metrics) {
+    int num_clusters = num_row_labels * num_col_labels;
+    int num_cols_recv = col_counts[rank];
+    int col_displacement = col_displacements[rank];
+    double* cluster_sum = workspace->cluster_sum.data();
+    index_type* cluster_size = workspace->cluster_size.data();
+    double* thread_cluster_sum = workspace->thread_cluster_sum.data();
+    index_type* thread_cluster_size = workspace->thread_cluster_size.data();
+    float* cluster_avg = workspace->cluster_avg.data();
+    label_type* scatter_col_labels = workspace->scatter_col_labels.data();
+    double* col_dist = workspace->col_dist.data();
+    double* row_dist = workspace->row_dist.data();
+    MPI_Request requests[3];
+    double start;
+
+    //// SECTION: calculate_cluster_average
+    set_phase(PHASE_CLUSTER_AVERAGE);
+
+    calculate_cluster_average(
+        num_row_labels,
+        num_col_labels,
+        cluster_sum,
+        cluster_size,
+        cluster_avg,
+        comms);
+
+    //// SECTION: update_row_labels
+    set_phase(PHASE_ROW_UPDATE);
+
+    // Distances of all rows over the columns of this rank
+    int num_dists = num_rows * num_row_labels;
+    std::fill(row_dist, row_dist + num_dists, 0.0);
+
+    start = MPI_Wtime();
+    accumulate_row_distances(
         num_rows,
+        num_cols_recv,
         num_cols,
+        num_row_labels,
         num_col_labels,
-        matrix,
+        matrix + col_displacement,
+        col_labels + col_displacement,
+        cluster_avg,
+        row_dist,
+        workspace->thread_row_dist.data());
+    *seconds = MPI_Wtime() - start;
+
+    MPI_Allreduce(MPI_IN_PLACE, row_dist, num_dists, MPI_DOUBLE, MPI_SUM, comm);
+
+    // All ranks have the same distances, so they arrive at the same labels
+    auto [num_rows_updated, _] = update_labels(
+        num_rows,
+        num_row_labels,
         row_labels,
-        scatter_col_labels.data(),
-        cluster_avg.data(),
-        col_displacement,
-        num_cols_recv);
+        row_dist);
 
-    // Synchronize col_labels, num_cols_updated and total_dist
-    MPI_Allgatherv(scatter_col_labels.data(),
-                   num_cols_recv,
-                   MPI_INT,
-                   col_labels,
-                   col_counts,
-                   col_displacements,
-                   MPI_INT,
-                   MPI_COMM_WORLD);
+    //// SECTION: update_col_labels
+    set_phase(PHASE_COL_UPDATE);
+
+    std::copy(
+        col_labels + col_displacement,
+        col_labels + col_displacement + num_cols_recv,
+        scatter_col_labels);
+    std::fill(col_dist, col_dist + size_t(num_cols_recv) * num_col_labels, 0.0);
+
+    start = MPI_Wtime();
+    accumulate_col_distances(
+        num_rows,
+        num_cols_recv,
+        num_cols,
+        num_col_labels,
+        matrix + col_displacement,
+        row_labels,
+        cluster_avg,
+        col_dist);
 
-    MPI_Allreduce(&num_cols_updated, &num_cols_updated, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
-    MPI_Allreduce(&total_dist, &total_dist, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+    auto [num_cols_updated, total_dist] = update_labels(
+        num_cols_recv,
+        num_col_labels,
+        scatter_col_labels,
+        col_dist);
+    *seconds += MPI_Wtime() - start;
+
+    // Start synchronizing col_labels, num_cols_updated and total_dist
+    MPI_Iallgatherv(scatter_col_labels,
+                    num_cols_recv,
+                    MPI_INT,
+                    col_labels,
+                    col_counts,
+                    col_displacements,
+                    MPI_INT,
+                    comm,
+                    &requests[0]);
+    MPI_Iallreduce(MPI_IN_PLACE, &num_cols_updated, 1, MPI_INT, MPI_SUM, comm, &requests[1]);
+    MPI_Iallreduce(MPI_IN_PLACE, &total_dist, 1, MPI_DOUBLE, MPI_SUM, comm, &requests[2]);
+
+    //// SECTION: accumulate cluster sums for the next iteration
+    set_phase(PHASE_CLUSTER_AVERAGE);
+
+    // The columns of this rank cover all rows, so the local cluster sums are
+    // complete without the labels of the other ranks
+    std::fill(cluster_sum, cluster_sum + num_clusters, 0.0);
+    std::fill(cluster_size, cluster_size + num_clusters, 0);
+
+    start = MPI_Wtime();
+    accumulate_cluster_sum(
+        num_rows,
+        num_cols_recv,
+        num_cols,
+        num_row_labels,
+        num_col_labels,
+        matrix + col_displacement,
+        row_labels,
+        scatter_col_labels,
+        cluster_sum,
+        cluster_size,
+        thread_cluster_sum,
+        thread_cluster_size);
+    *seconds += MPI_Wtime() - start;
+
+    MPI_Waitall(3, requests, MPI_STATUSES_IGNORE);
+
+    set_phase(PHASE_OTHER);
+    metrics->rows_updated = num_rows_updated;
+    metrics->cols_updated = num_cols_updated;
+    metrics->objective = total_dist;
+    metrics->distance_evaluations =
+        double(num_rows) * num_cols * (num_row_labels + num_col_labels);
 
     return {num_rows_updated + num_cols_updated, total_dist};
 }
 
+/**
+ * Whether to partition the row update by column (see
+ * `cluster_split_rows_iteration`) rather than by row. This is the case for
+ * wide matrices that have fewer than a few rows per thread, since whole rows
+ * cannot be balanced over the threads of all ranks.
+ */
+bool use_split_rows(int num_rows, int num_cols, int num_threads) {
+    return num_cols > num_rows && num_rows < 4 * num_threads;
+}
+
 /**
  * Repeatedly calls `cluster_serial_iteration` to iteratively update the
  * labels along the rows and columns. This function performs
- * `max_iterations` iterations or until convergence.
+ * `max_iterations` iterations or until convergence, using the ranks of
+ * `comm`. It returns the number of iterations and the final average error.
+ *
+ * Wide matrices with few rows use `cluster_split_rows_iteration` instead,
+ * see `use_split_rows`.
+ *
+ * If `rebalance` is set, the rows and columns are repartitioned between
+ * iterations based on the measured compute time of each rank. This requires
+ * no data migration, since every rank holds all labels and the full matrix.
+ * The matrix elements are of type T, which depends on the storage strategy
+ * (see memory.h).
  */
-void cluster_serial(
+template<typename T>
+std::pair<int, double> cluster_serial(
+    MPI_Comm comm,
     int num_rows,
     int num_cols,
     int num_row_labels,
     int num_col_labels,
-    float* matrix,
+    const T* matrix,
     label_type* row_labels,
     label_type* col_labels,
-    int max_iterations = 25) {
+    int max_iterations = 25,
+    bool rebalance = false) {
     int iteration = 0;
+    double average_dist = 0;
     auto before = std::chrono::high_resolution_clock::now();
 
     int size, rank;
-    MPI_Comm_size(MPI_COMM_WORLD, &size);
-    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(comm, &size);
+    MPI_Comm_rank(comm, &rank);
+
+    bool split_rows = use_split_rows(num_rows, num_cols, size * omp_get_max_threads());
+
+    if (rank == 0) {
+        fprintf(stderr, " * ranks: %d\n", size);
+        fprintf(stderr, " * threads per rank: %d\n", omp_get_max_threads());
+        fprintf(stderr, " * partition: %s\n", split_rows ? "columns" : "rows and columns");
+    }
 
     // Calculate values to scatter the row_labels and col_labels on using our helper function.
     std::vector<int> row_counts, row_displacements, col_counts, col_displacements;
@@ -345,26 +1116,94 @@ void cluster_serial(
     col_counts = col_scatter.first;
     col_displacements = col_scatter.second;
 
+    // Communicators for reducing the cluster sums, reused by every iteration
+    auto comms = create_reduction_comms(comm);
+
+    iteration_workspace workspace;
+    resize_workspace(
+        &workspace,
+        num_rows,
+        num_row_labels,
+        num_col_labels,
+        row_counts[rank],
+        col_counts[rank],
+        split_rows);
+
+    // The local cluster sums for the initial labels. Later iterations
+    // accumulate them while exchanging the updated column labels.
+    accumulate_cluster_sum(
+        row_counts[rank],
+        num_cols,
+        num_cols,
+        num_row_labels,
+        num_col_labels,
+        matrix + index_type(row_displacements[rank]) * num_cols,
+        row_labels + row_displacements[rank],
+        col_labels,
+        workspace.cluster_sum.data(),
+        workspace.cluster_size.data(),
+        workspace.thread_cluster_sum.data(),
+        workspace.thread_cluster_size.data());
 
     while (iteration < max_iterations) {
-        auto [num_updated, total_dist] = cluster_serial_iteration(
-            num_rows,
-            num_cols,
-            num_row_labels,
-            num_col_labels,
-            matrix,
-            row_labels,
-            col_labels,
-            rank,
-            row_counts.data(),
-            row_displacements.data(),
-            col_counts.data(),
-            col_displacements.data());
+        double row_seconds, col_seconds;
+        TRACE_SCOPE("iteration", "iteration");
+        iteration_metrics metrics;
+        metrics_begin_iteration();
+        long allocations = heap_allocation_count();
+
+        int num_updated;
+        double total_dist;
+
+        if (split_rows) {
+            row_seconds = 0;
+            std::tie(num_updated, total_dist) = cluster_split_rows_iteration(
+                num_rows,
+                num_cols,
+                num_row_labels,
+                num_col_labels,
+                matrix,
+                row_labels,
+                col_labels,
+                &workspace,
+                comm,
+                comms,
+                rank,
+                col_counts.data(),
+                col_displacements.data(),
+                &col_seconds,
+                &metrics);
+        } else {
+            std::tie(num_updated, total_dist) = cluster_serial_iteration(
+                num_rows,
+                num_cols,
+                num_row_labels,
+                num_col_labels,
+                matrix,
+                row_labels,
+                col_labels,
+                &workspace,
+                comm,
+                comms,
+                rank,
+                row_counts.data(),
+                row_displacements.data(),
+                col_counts.data(),
+                col_displacements.data(),
+                &row_seconds,
+                &col_seconds,
+                &metrics);
+        }
+
+        if (iteration > 0) {
+            check_no_allocations(allocations, "cluster_serial_iteration");
+        }
 
         iteration++;
+        average_dist = total_dist / (double(num_rows) * num_cols);
+        metrics_end_iteration(iteration, double(num_rows) * num_cols, metrics);
 
         if (rank == 0) {
-            auto average_dist = total_dist / (num_rows * num_cols);
             std::cout << "iteration " << iteration << ": " << num_updated
                     << " labels were updated, average error is " << average_dist
                     << "\n";
@@ -373,22 +1212,349 @@ void cluster_serial(
         if (num_updated == 0) {
             break;
         }
+
+        // The local cluster sums cover the old row partition, which is fine
+        // since only their sum over all ranks is used.
+        if (rebalance) {
+            // In split mode, all work is partitioned by column
+            if (!split_rows) {
+                rebalance_scatter(num_rows, row_seconds, &row_counts, &row_displacements, comm);
+            }
+
+            rebalance_scatter(num_cols, col_seconds, &col_counts, &col_displacements, comm);
+            resize_workspace(
+                &workspace,
+                num_rows,
+                num_row_labels,
+                num_col_labels,
+                row_counts[rank],
+                col_counts[rank],
+                split_rows);
+        }
     }
 
     auto after = std::chrono::high_resolution_clock::now();
     auto time_seconds = std::chrono::duration<double>(after - before).count();
+
+    // The hardware counters are summed over all ranks
+    double counters[NUM_PHASES][NUM_PERF_COUNTERS];
+
+    if (perf_counters_enabled) {
+        set_phase(PHASE_OTHER);
+        MPI_Reduce(
+            phase_counters,
+            counters,
+            NUM_PHASES * NUM_PERF_COUNTERS,
+            MPI_DOUBLE,
+            MPI_SUM,
+            0,
+            comm);
+    }
+
     if (rank == 0) {
         std::cout << "clustering time total: " << time_seconds << " seconds\n";
         std::cout << "clustering time per iteration: " << (time_seconds / iteration)
                 << " seconds\n";
+        print_phase_times();
+        print_phase_counters(counters, double(num_rows) * num_cols * iteration);
+    }
+    free_reduction_comms(&comms);
+    return {iteration, average_dist};
+}
+
+/**
+ * Load the matrix from `file_name` into memory shared by all ranks of
+ * `node_comm`. Only the first rank of each node reads the file; the other
+ * ranks access the same memory directly. The matrix is stored as T (float or
+ * bfloat16). The returned pointer remains valid until `win` is freed.
+ */
+template<typename T>
+T* load_shared_matrix(
+    const std::string& file_name,
+    int num_rows,
+    int num_cols,
+    MPI_Comm node_comm,
+    MPI_Win* win) {
+    int node_rank;
+    MPI_Comm_rank(node_comm, &node_rank);
+
+    size_t num_items = size_t(num_rows) * size_t(num_cols);
+    MPI_Aint bytes = node_rank == 0 ? num_items * sizeof(T) : 0;
+    T* matrix;
+    MPI_Win_allocate_shared(
+        bytes,
+        sizeof(T),
+        MPI_INFO_NULL,
+        node_comm,
+        &matrix,
+        win);
+
+    // Every rank uses the segment owned by the first rank on the node
+    int disp_unit;
+    MPI_Win_shared_query(*win, 0, &bytes, &disp_unit, &matrix);
+
+    MPI_Win_fence(0, *win);
+
+    if (node_rank == 0) {
+        std::vector<unsigned long> shape;
+        size_t data_offset;
+        read_matrix_header(file_name, &shape, &data_offset);
+        memory_track(MEMORY_MATRIX, double(bytes));
+
+        if (!read_matrix_data(file_name, data_offset, num_items, matrix)
+            || !check_matrix_values(file_name, num_rows, num_cols, matrix)) {
+            MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        }
+    }
+
+    MPI_Win_fence(0, *win);
+    return matrix;
+}
+
+/**
+ * Collectively write the `size` bytes at `data` to `file` at `offset`. MPI
+ * counts are ints, so large buffers are written in chunks of 1 GiB; every rank
+ * of `comm` takes part in the same number of writes, even after one of them
+ * failed. Returns false if a write of this rank failed.
+ */
+bool write_at_all_chunked(
+    MPI_File file,
+    MPI_Offset offset,
+    const char* data,
+    long long size,
+    MPI_Comm comm) {
+    const long long chunk_size = 1LL << 30;
+    long long num_chunks = (size + chunk_size - 1) / chunk_size;
+    MPI_Allreduce(MPI_IN_PLACE, &num_chunks, 1, MPI_LONG_LONG, MPI_MAX, comm);
+    bool ok = true;
+
+    for (long long i = 0; i < num_chunks; i++) {
+        long long begin = std::min(i * chunk_size, size);
+        long long end = std::min(begin + chunk_size, size);
+
+        int err = MPI_File_write_at_all(
+            file,
+            offset + MPI_Offset(begin),
+            data + begin,
+            int(end - begin),
+            MPI_CHAR,
+            MPI_STATUS_IGNORE);
+        ok = ok && err == MPI_SUCCESS;
+    }
+
+    return ok;
+}
+
+/**
+ * Write the labels in `row_labels` and `col_labels`, which are identical on
+ * every rank of `comm`, to `file_name` using collective MPI-IO writes. Each
+ * rank writes the block of rows and columns it owns. The file format is the
+ * same as for `write_labels`. For the text format, the offset of each rank is
+ * the prefix sum of the formatted sizes on the preceding ranks.
+ *
+ * Returns false, on every rank, if the file could not be opened or a write
+ * on any rank failed.
+ */
+bool write_labels_parallel(
+    MPI_Comm comm,
+    const std::string& file_name,
+    int num_rows,
+    int num_cols,
+    const label_type* row_labels,
+    const label_type* col_labels) {
+    int size, rank;
+    MPI_Comm_size(comm, &size);
+    MPI_Comm_rank(comm, &rank);
+
+    if (rank == 0) {
+        fprintf(stderr, "writing result to %s\n", file_name.c_str());
+    }
+
+    MPI_File file;
+    int err = MPI_File_open(
+        comm,
+        file_name.c_str(),
+        MPI_MODE_CREATE | MPI_MODE_WRONLY,
+        MPI_INFO_NULL,
+        &file);
+
+    if (err != MPI_SUCCESS) {
+        fprintf(stderr, "error: could not open: %s\n", file_name.c_str());
+        return false;
+    }
+
+    bool ok = MPI_File_set_size(file, 0) == MPI_SUCCESS;
+
+    auto [row_counts, row_displacements] = calculate_scatter(num_rows, size);
+    auto [col_counts, col_displacements] = calculate_scatter(num_cols, size);
+    const label_type* rows = row_labels + row_displacements[rank];
+    const label_type* cols = col_labels + col_displacements[rank];
+    if (is_binary_label_file(file_name)) {
+        int header[2] = {num_rows, num_cols};
+        MPI_Offset header_size = sizeof(header);
+        MPI_Offset row_offset =
+            header_size + MPI_Offset(row_displacements[rank]) * sizeof(label_type);
+        MPI_Offset col_offset = header_size
+            + (MPI_Offset(num_rows) + col_displacements[rank]) * sizeof(label_type);
+
+        int errs[3] = {
+            MPI_File_write_at_all(file, 0, header, rank == 0 ? 2 : 0, MPI_INT, MPI_STATUS_IGNORE),
+            MPI_File_write_at_all(file, row_offset, rows, row_counts[rank], MPI_INT, MPI_STATUS_IGNORE),
+            MPI_File_write_at_all(file, col_offset, cols, col_counts[rank], MPI_INT, MPI_STATUS_IGNORE),
+        };
+
+        for (int err : errs) {
+            ok = ok && err == MPI_SUCCESS;
+        }
+    } else {
+        // Format the labels of this rank. The last rank also writes the
+        // empty line that terminates each section.
+        std::string row_text, col_text;
+
+        for (int i = 0; i < row_counts[rank]; i++) {
+            row_text += std::to_string(rows[i]) + "\n";
+        }
+
+        for (int j = 0; j < col_counts[rank]; j++) {
+            col_text += std::to_string(cols[j]) + "\n";
+        }
+
+        if (rank == size - 1) {
+            row_text += "\n";
+            col_text += "\n";
+        }
+
+        // The offset of a section of this rank is the size of the same
+        // section on all preceding ranks
+        long long sizes[2] = {(long long)row_text.size(), (long long)col_text.size()};
+        long long offsets[2] = {0, 0};
+        long long row_total = 0;
+        MPI_Exscan(sizes, offsets, 2, MPI_LONG_LONG, MPI_SUM, comm);
+        MPI_Allreduce(&sizes[0], &row_total, 1, MPI_LONG_LONG, MPI_SUM, comm);
+
+        if (rank == 0) {
+            offsets[0] = offsets[1] = 0;
+        }
+
+        ok = write_at_all_chunked(file, MPI_Offset(offsets[0]), row_text.data(), sizes[0], comm)
+            && ok;
+        ok = write_at_all_chunked(
+                 file,
+                 MPI_Offset(row_total + offsets[1]),
+                 col_text.data(),
+                 sizes[1],
+                 comm)
+            && ok;
+    }
+
+    ok = MPI_File_close(&file) == MPI_SUCCESS && ok;
+
+    // Every rank returns false if a write failed on any rank
+    int all_ok = ok;
+    MPI_Allreduce(MPI_IN_PLACE, &all_ok, 1, MPI_INT, MPI_MIN, comm);
+
+    if (!all_ok && rank == 0) {
+        fprintf(stderr, "error: could not write: %s\n", file_name.c_str());
+    }
+
+    return all_ok != 0;
+}
+
+/**
+ * Returns the output file of ensemble member `member`, for example
+ * "labels.txt" becomes "labels.3.txt".
+ */
+std::string ensemble_output_file(const std::string& file_name, int member) {
+    auto slash = file_name.find_last_of('/');
+    auto dot = file_name.find_last_of('.');
+
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+        return file_name + "." + std::to_string(member);
+    }
+
+    return file_name.substr(0, dot) + "." + std::to_string(member)
+        + file_name.substr(dot);
+}
+
+/**
+ * Gather the results of all ensemble members on rank 0 of MPI_COMM_WORLD and
+ * print a summary. Only the first rank of each member contributes.
+ */
+void report_ensemble(
+    bool is_leader,
+    int member,
+    int seed,
+    int num_row_labels,
+    int num_col_labels,
+    int iterations,
+    double average_dist,
+    const std::string& output_file) {
+    int world_rank, world_size;
+    MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &world_size);
+
+    const int num_fields = 7;
+    double result[num_fields] = {
+        double(is_leader),
+        double(member),
+        double(seed),
+        double(num_row_labels),
+        double(num_col_labels),
+        double(iterations),
+        average_dist};
+    auto results = std::vector<double>(world_rank == 0 ? world_size * num_fields : 0);
+
+    MPI_Gather(
+        result,
+        num_fields,
+        MPI_DOUBLE,
+        results.data(),
+        num_fields,
+        MPI_DOUBLE,
+        0,
+        MPI_COMM_WORLD);
+
+    if (world_rank != 0) {
+        return;
     }
+
+    int best_member = -1;
+    double best_dist = INFINITY;
+
+    for (int i = 0; i < world_size; i++) {
+        const double* r = &results[i * num_fields];
+
+        if (r[0] == 0) {
+            continue;
+        }
+
+        std::cout << "ensemble member " << int(r[1]) << ": seed " << int(r[2])
+                  << ", " << int(r[3]) << "x" << int(r[4]) << " labels, "
+                  << int(r[5]) << " iterations, average error is " << r[6]
+                  << ", output " << ensemble_output_file(output_file, int(r[1]))
+                  << "\n";
+
+        if (r[6] < best_dist) {
+            best_dist = r[6];
+            best_member = int(r[1]);
+        }
+    }
+
+    std::cout << "best ensemble member: " << best_member << "\n";
 }
 
 int main(int argc, const char* argv[]) {
-    MPI_Init(NULL, NULL);
+    // Threads only compute; all communication is done by the master thread
+    int provided;
+    MPI_Init_thread(NULL, NULL, MPI_THREAD_FUNNELED, &provided);
 
-    std::string output_file;
-    std::vector<float> matrix;
+    if (provided < MPI_THREAD_FUNNELED) {
+        fprintf(stderr, "error: MPI library does not support MPI_THREAD_FUNNELED\n");
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+
+    std::string input_file, output_file;
+    std::vector<float> unused_matrix;
     std::vector<label_type> row_labels, col_labels;
     int num_rows = 0, num_cols = 0;
     int num_row_labels = 0, num_col_labels = 0;
@@ -396,50 +1562,304 @@ int main(int argc, const char* argv[]) {
 
     auto before = std::chrono::high_resolution_clock::now();
 
+    auto program = create_argument_parser(argv[0]);
+    program.add_argument("--rebalance")
+        .help("Repartition rows and columns between ranks based on measured compute time")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("--profile")
+        .help("Print a profile of the MPI communication per phase at exit")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("--ensemble")
+        .scan<'i', int>()
+        .help("Split the ranks into this many groups, each clustering with a different seed")
+        .default_value(1);
+
+    program.add_argument("--ensemble-labels")
+        .help("Comma-separated label counts (e.g., 5x100,10x20) used by the ensemble members in turn")
+        .default_value(std::string(""));
+
     // Parse arguments
     if (!parse_arguments(
+            program,
             argc,
             argv,
             &num_rows,
             &num_cols,
             &num_row_labels,
             &num_col_labels,
-            &matrix,
+            &unused_matrix,
             &row_labels,
             &col_labels,
             &output_file,
-            &max_iter)) {
+            &max_iter,
+            &input_file)) {
+        MPI_Finalize();
+        return EXIT_FAILURE;
+    }
+
+    if (program.get<bool>("--profile")) {
+        profile_enable();
+    }
+
+    // The counters must be opened before the OpenMP threads are created
+    if (program.get<bool>("--counters")) {
+        enable_phase_counters();
+    }
+
+    int world_rank, world_size;
+    MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &world_size);
+
+    // All ranks start the trace clock after a barrier
+    std::string trace_file = program.get("--trace");
+
+    if (!trace_file.empty()) {
+        MPI_Barrier(MPI_COMM_WORLD);
+        trace_enable();
+    }
+
+    int ensemble_size = program.get<int>("--ensemble");
+    std::vector<std::pair<int, int>> label_configs;
+
+    if (ensemble_size < 1 || ensemble_size > world_size
+        || !parse_label_configs(program.get("--ensemble-labels"), &label_configs)) {
+        if (world_rank == 0) {
+            fprintf(stderr, "error: invalid ensemble configuration\n");
+        }
+
+        MPI_Finalize();
         return EXIT_FAILURE;
     }
 
+    // The members start from their own random labels, which would silently
+    // replace the initial labels of a label file
+    if (ensemble_size > 1
+        && !std::regex_match(program.get("input-labels"), std::regex("[0-9]+x[0-9]+"))) {
+        if (world_rank == 0) {
+            fprintf(stderr, "error: --ensemble cannot be combined with a label file\n");
+        }
+
+        MPI_Finalize();
+        return EXIT_FAILURE;
+    }
+
+    // Each ensemble member runs on its own contiguous group of ranks, using
+    // its own seed and, optionally, its own number of labels.
+    MPI_Comm comm = MPI_COMM_WORLD;
+    int member = 0;
+    int seed = program.get<int>("--seed");
+    std::string member_output_file = output_file;
+
+    if (ensemble_size > 1) {
+        member = int((long(world_rank) * ensemble_size) / world_size);
+        MPI_Comm_split(MPI_COMM_WORLD, member, world_rank, &comm);
+
+        if (!label_configs.empty()) {
+            auto config = label_configs[member % label_configs.size()];
+            num_row_labels = config.first;
+            num_col_labels = config.second;
+        }
+
+        seed += member;
+        auto rng = std::default_random_engine(seed);
+        row_labels = initialize_labels(num_rows, num_row_labels, rng);
+        col_labels = initialize_labels(num_cols, num_col_labels, rng);
+        member_output_file = ensemble_output_file(output_file, member);
+    }
+
+    // Ranks on the same node share a single copy of the matrix
+    MPI_Comm node_comm;
+    MPI_Comm_split_type(
+        MPI_COMM_WORLD,
+        MPI_COMM_TYPE_SHARED,
+        0,
+        MPI_INFO_NULL,
+        &node_comm);
+
+    int rank, size;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+    memory_track(MEMORY_LABELS, double(num_rows + num_cols) * sizeof(label_type));
+
+    // The memory limit applies per node: one copy of the matrix plus the
+    // buffers of every rank on the node. All nodes use the same strategy.
+    double memory_limit = 0;
+    std::string memory_limit_text = program.get("--memory-limit");
+
+    if (!memory_limit_text.empty() && !parse_memory_size(memory_limit_text, &memory_limit)) {
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+
+    double buffer_bytes =
+        estimate_buffer_bytes(num_rows, num_cols, num_row_labels, num_col_labels)
+        + estimate_workspace_bytes(
+            num_rows,
+            num_cols,
+            num_row_labels,
+            num_col_labels,
+            size,
+            omp_get_max_threads(),
+            use_split_rows(num_rows, num_cols, size * omp_get_max_threads()));
+    MPI_Allreduce(MPI_IN_PLACE, &buffer_bytes, 1, MPI_DOUBLE, MPI_SUM, node_comm);
+    MPI_Allreduce(MPI_IN_PLACE, &buffer_bytes, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+
+    matrix_strategy strategy = STRATEGY_IN_MEMORY;
+
+    if (!select_matrix_strategy(
+            memory_limit,
+            double(num_rows) * num_cols,
+            1,
+            buffer_bytes,
+            &strategy)) {
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+
+    if (world_rank == 0) {
+        fprintf(stderr, " * matrix storage: %s\n", matrix_strategy_name(strategy));
+    }
+
+    // In memory, the matrix is shared by the ranks of a node. Out of core,
+    // every rank maps the file, and the pages are shared by the page cache.
+    MPI_Win matrix_win = MPI_WIN_NULL;
+    const float* matrix = nullptr;
+    const bfloat16* reduced_matrix = nullptr;
+    matrix_storage mapped_matrix;
+    double load_start = MPI_Wtime();
+    {
+        TRACE_SCOPE("load_shared_matrix", "io");
+
+        if (strategy == STRATEGY_IN_MEMORY) {
+            matrix = load_shared_matrix<float>(
+                input_file,
+                num_rows,
+                num_cols,
+                node_comm,
+                &matrix_win);
+        } else if (strategy == STRATEGY_REDUCED_PRECISION) {
+            reduced_matrix = load_shared_matrix<bfloat16>(
+                input_file,
+                num_rows,
+                num_cols,
+                node_comm,
+                &matrix_win);
+        } else if (load_matrix(input_file, num_rows, num_cols, strategy, &mapped_matrix)) {
+            matrix = mapped_matrix.mapped_values;
+        } else {
+            MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        }
+    }
+    io_seconds += MPI_Wtime() - load_start;
+
+    // The first rank of every ensemble member writes its metrics
+    std::string metrics_file = program.get("--metrics");
+
+    if (!metrics_file.empty() && rank == 0) {
+        if (ensemble_size > 1) {
+            metrics_file = ensemble_output_file(metrics_file, member);
+        }
+
+        if (!metrics_open(metrics_file)) {
+            MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        }
+    }
+
     // Cluster labels
-    cluster_serial(
-        num_rows,
-        num_cols,
-        num_row_labels,
-        num_col_labels,
-        matrix.data(),
-        row_labels.data(),
-        col_labels.data(),
-        max_iter);
-
-    int rank; 
-    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
-    
-    if (rank == 0) {
-        // Write resulting labels
-        write_labels(
-        output_file,
-        num_rows,
-        num_cols,
-        row_labels.data(),
-        col_labels.data());
+    int iterations;
+    double average_dist;
 
+    if (reduced_matrix != nullptr) {
+        std::tie(iterations, average_dist) = cluster_serial(
+            comm,
+            num_rows,
+            num_cols,
+            num_row_labels,
+            num_col_labels,
+            reduced_matrix,
+            row_labels.data(),
+            col_labels.data(),
+            max_iter,
+            program.get<bool>("--rebalance"));
+    } else {
+        std::tie(iterations, average_dist) = cluster_serial(
+            comm,
+            num_rows,
+            num_cols,
+            num_row_labels,
+            num_col_labels,
+            matrix,
+            row_labels.data(),
+            col_labels.data(),
+            max_iter,
+            program.get<bool>("--rebalance"));
+    }
+
+    // The peak memory use of the rank that used the most
+    double memory_usage[NUM_MEMORY_COMPONENTS + 2];
+    memory_peaks(memory_usage);
+    MPI_Reduce(
+        world_rank == 0 ? MPI_IN_PLACE : memory_usage,
+        memory_usage,
+        NUM_MEMORY_COMPONENTS + 2,
+        MPI_DOUBLE,
+        MPI_MAX,
+        0,
+        MPI_COMM_WORLD);
+
+    if (world_rank == 0) {
+        print_memory_usage(memory_usage);
+    }
+
+    // Write resulting labels
+    {
+        TRACE_SCOPE("write_labels_parallel", "io");
+
+        if (!write_labels_parallel(
+                comm,
+                member_output_file,
+                num_rows,
+                num_cols,
+                row_labels.data(),
+                col_labels.data())) {
+            MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        }
+    }
+
+    metrics_close(std::chrono::duration<double>(
+        std::chrono::high_resolution_clock::now() - before).count());
+
+    if (ensemble_size > 1) {
+        report_ensemble(
+            rank == 0,
+            member,
+            seed,
+            num_row_labels,
+            num_col_labels,
+            iterations,
+            average_dist,
+            output_file);
+        MPI_Comm_free(&comm);
+    }
+
+    if (world_rank == 0) {
         auto after = std::chrono::high_resolution_clock::now();
         auto time_seconds = std::chrono::duration<double>(after - before).count();
 
         std::cout << "total execution time: " << time_seconds << " seconds\n";
     }
 
-    return EXIT_SUCCESS;
+    profile_report(MPI_COMM_WORLD);
+    bool ok = trace_file.empty() || trace_write_all(MPI_COMM_WORLD, trace_file);
+
+    if (matrix_win != MPI_WIN_NULL) {
+        MPI_Win_free(&matrix_win);
+    }
+
+    unload_matrix(&mapped_matrix);
+    MPI_Comm_free(&node_comm);
+    MPI_Finalize();
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
 }
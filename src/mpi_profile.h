@@ -0,0 +1,472 @@
+#pragma once
+
+#include <cstdio>
+#include <mpi.h>
+#include <string>
+#include <vector>
+
+#include "timing.h"
+
+/**
+ * Communication profiler for cgc_mpi. The collectives used by cgc_mpi are
+ * intercepted through the MPI profiling interface (PMPI): each wrapper below
+ * forwards to the corresponding PMPI function and, if profiling is enabled,
+ * records the number of calls, the number of bytes sent by this rank and the
+ * time spent in the call. The records are kept per algorithm phase, which is
+ * set with `set_phase` (see timing.h). For nonblocking collectives, the time
+ * until completion is recorded by `MPI_Wait`/`MPI_Waitall` in the current
+ * phase. If tracing is enabled (see trace.h), every call is also recorded on
+ * the timeline.
+ */
+enum profile_call {
+    CALL_ALLREDUCE,
+    CALL_IALLREDUCE,
+    CALL_IREDUCE,
+    CALL_IBCAST,
+    CALL_ALLGATHER,
+    CALL_ALLGATHERV,
+    CALL_IALLGATHERV,
+    CALL_SCATTERV,
+    CALL_GATHER,
+    CALL_EXSCAN,
+    CALL_WAIT,
+    CALL_FILE_WRITE,
+    NUM_CALLS
+};
+
+static const char* profile_call_names[NUM_CALLS] = {
+    "MPI_Allreduce",
+    "MPI_Iallreduce",
+    "MPI_Ireduce",
+    "MPI_Ibcast",
+    "MPI_Allgather",
+    "MPI_Allgatherv",
+    "MPI_Iallgatherv",
+    "MPI_Scatterv",
+    "MPI_Gather",
+    "MPI_Exscan",
+    "MPI_Wait(all)",
+    "MPI_File_write_at_all",
+};
+
+struct profile_entry {
+    double calls;
+    double bytes;
+    double seconds;
+};
+
+static bool profile_enabled = false;
+static profile_entry profile_entries[NUM_PHASES][NUM_CALLS];
+
+static inline void profile_enable() {
+    profile_enabled = true;
+}
+
+/**
+ * Record a call that started at `start`. The time is always added to the
+ * communication or I/O time of timing.h, which is cheap; the per-call
+ * records are only kept if profiling is enabled.
+ */
+static inline void profile_record(
+    profile_call call,
+    int count,
+    MPI_Datatype datatype,
+    double start) {
+    double elapsed = PMPI_Wtime() - start;
+
+    if (call == CALL_FILE_WRITE) {
+        io_seconds += elapsed;
+    } else {
+        communication_seconds += elapsed;
+    }
+
+    if (trace_enabled) {
+        trace_record(profile_call_names[call], "mpi", trace_now() - elapsed, elapsed);
+    }
+
+    if (!profile_enabled) {
+        return;
+    }
+
+    int type_size = 0;
+
+    if (count > 0) {
+        PMPI_Type_size(datatype, &type_size);
+    }
+
+    auto& entry = profile_entries[current_phase][call];
+    entry.calls += 1;
+    entry.bytes += double(count) * type_size;
+    entry.seconds += elapsed;
+}
+
+/**
+ * Print the profile of all ranks of `comm` on its first rank. For each phase
+ * and call, the calls, bytes and time are summed over the ranks; the time is
+ * also reported as the minimum and maximum over the ranks, since a large
+ * spread indicates load imbalance rather than communication cost.
+ */
+static inline void profile_report(MPI_Comm comm) {
+    if (!profile_enabled) {
+        return;
+    }
+
+    set_phase(PHASE_OTHER);
+
+    int rank, size;
+    PMPI_Comm_rank(comm, &rank);
+    PMPI_Comm_size(comm, &size);
+
+    const int num_values = NUM_PHASES * (NUM_CALLS * 3 + 1);
+    double local[num_values], sum[num_values], min[num_values], max[num_values];
+    int n = 0;
+
+    for (int p = 0; p < NUM_PHASES; p++) {
+        for (int c = 0; c < NUM_CALLS; c++) {
+            local[n++] = profile_entries[p][c].calls;
+            local[n++] = profile_entries[p][c].bytes;
+            local[n++] = profile_entries[p][c].seconds;
+        }
+
+        local[n++] = phase_seconds[p];
+    }
+
+    PMPI_Reduce(local, sum, num_values, MPI_DOUBLE, MPI_SUM, 0, comm);
+    PMPI_Reduce(local, min, num_values, MPI_DOUBLE, MPI_MIN, 0, comm);
+    PMPI_Reduce(local, max, num_values, MPI_DOUBLE, MPI_MAX, 0, comm);
+
+    if (rank != 0) {
+        return;
+    }
+
+    fprintf(stderr, "communication profile (%d ranks):\n", size);
+    fprintf(
+        stderr,
+        " %-26s %-22s %10s %14s %12s %12s %12s\n",
+        "phase",
+        "call",
+        "calls",
+        "bytes",
+        "avg time",
+        "min time",
+        "max time");
+    n = 0;
+
+    for (int p = 0; p < NUM_PHASES; p++) {
+        for (int c = 0; c < NUM_CALLS; c++, n += 3) {
+            if (sum[n] == 0) {
+                continue;
+            }
+
+            fprintf(
+                stderr,
+                " %-26s %-22s %10.0f %14.0f %12.6f %12.6f %12.6f\n",
+                phase_names[p],
+                profile_call_names[c],
+                sum[n],
+                sum[n + 1],
+                sum[n + 2] / size,
+                min[n + 2],
+                max[n + 2]);
+        }
+
+        fprintf(
+            stderr,
+            " %-26s %-22s %10s %14s %12.6f %12.6f %12.6f\n",
+            phase_names[p],
+            "(phase total)",
+            "",
+            "",
+            sum[n] / size,
+            min[n],
+            max[n]);
+        n++;
+    }
+}
+
+/**
+ * Gather the trace events of all ranks of `comm` and write them to
+ * `file_name` on its first rank. Returns false on the first rank if the file
+ * could not be written.
+ */
+static inline bool trace_write_all(MPI_Comm comm, const std::string& file_name) {
+    int rank, size;
+    PMPI_Comm_rank(comm, &rank);
+    PMPI_Comm_size(comm, &size);
+
+    auto events = trace_serialize(rank);
+    int length = int(events.size());
+    auto lengths = std::vector<int>(size);
+    auto displs = std::vector<int>(size, 0);
+
+    PMPI_Gather(&length, 1, MPI_INT, lengths.data(), 1, MPI_INT, 0, comm);
+
+    // Events of different ranks are separated by ",\n"
+    std::string all_events;
+
+    if (rank == 0) {
+        int total = 0;
+
+        for (int i = 0; i < size; i++) {
+            displs[i] = total + 2 * i;
+            total += lengths[i];
+        }
+
+        all_events.assign(total + 2 * (size - 1), ',');
+
+        for (int i = 1; i < size; i++) {
+            all_events[displs[i] - 1] = '\n';
+        }
+    }
+
+    PMPI_Gatherv(
+        events.data(),
+        length,
+        MPI_CHAR,
+        &all_events[0],
+        lengths.data(),
+        displs.data(),
+        MPI_CHAR,
+        0,
+        comm);
+
+    return rank != 0 || trace_write(file_name, all_events);
+}
+
+int MPI_Allreduce(
+    const void* sendbuf,
+    void* recvbuf,
+    int count,
+    MPI_Datatype datatype,
+    MPI_Op op,
+    MPI_Comm comm) {
+    double start = PMPI_Wtime();
+    int err = PMPI_Allreduce(sendbuf, recvbuf, count, datatype, op, comm);
+
+    profile_record(CALL_ALLREDUCE, count, datatype, start);
+
+    return err;
+}
+
+int MPI_Iallreduce(
+    const void* sendbuf,
+    void* recvbuf,
+    int count,
+    MPI_Datatype datatype,
+    MPI_Op op,
+    MPI_Comm comm,
+    MPI_Request* request) {
+    double start = PMPI_Wtime();
+    int err = PMPI_Iallreduce(sendbuf, recvbuf, count, datatype, op, comm, request);
+
+    profile_record(CALL_IALLREDUCE, count, datatype, start);
+
+    return err;
+}
+
+int MPI_Ireduce(
+    const void* sendbuf,
+    void* recvbuf,
+    int count,
+    MPI_Datatype datatype,
+    MPI_Op op,
+    int root,
+    MPI_Comm comm,
+    MPI_Request* request) {
+    double start = PMPI_Wtime();
+    int err = PMPI_Ireduce(sendbuf, recvbuf, count, datatype, op, root, comm, request);
+
+    profile_record(CALL_IREDUCE, count, datatype, start);
+
+    return err;
+}
+
+int MPI_Ibcast(
+    void* buffer,
+    int count,
+    MPI_Datatype datatype,
+    int root,
+    MPI_Comm comm,
+    MPI_Request* request) {
+    double start = PMPI_Wtime();
+    int err = PMPI_Ibcast(buffer, count, datatype, root, comm, request);
+
+    profile_record(CALL_IBCAST, count, datatype, start);
+
+    return err;
+}
+
+int MPI_Allgather(
+    const void* sendbuf,
+    int sendcount,
+    MPI_Datatype sendtype,
+    void* recvbuf,
+    int recvcount,
+    MPI_Datatype recvtype,
+    MPI_Comm comm) {
+    double start = PMPI_Wtime();
+    int err = PMPI_Allgather(
+        sendbuf,
+        sendcount,
+        sendtype,
+        recvbuf,
+        recvcount,
+        recvtype,
+        comm);
+
+    profile_record(CALL_ALLGATHER, sendcount, sendtype, start);
+
+    return err;
+}
+
+int MPI_Allgatherv(
+    const void* sendbuf,
+    int sendcount,
+    MPI_Datatype sendtype,
+    void* recvbuf,
+    const int recvcounts[],
+    const int displs[],
+    MPI_Datatype recvtype,
+    MPI_Comm comm) {
+    double start = PMPI_Wtime();
+    int err = PMPI_Allgatherv(
+        sendbuf,
+        sendcount,
+        sendtype,
+        recvbuf,
+        recvcounts,
+        displs,
+        recvtype,
+        comm);
+
+    profile_record(CALL_ALLGATHERV, sendcount, sendtype, start);
+
+    return err;
+}
+
+int MPI_Iallgatherv(
+    const void* sendbuf,
+    int sendcount,
+    MPI_Datatype sendtype,
+    void* recvbuf,
+    const int recvcounts[],
+    const int displs[],
+    MPI_Datatype recvtype,
+    MPI_Comm comm,
+    MPI_Request* request) {
+    double start = PMPI_Wtime();
+    int err = PMPI_Iallgatherv(
+        sendbuf,
+        sendcount,
+        sendtype,
+        recvbuf,
+        recvcounts,
+        displs,
+        recvtype,
+        comm,
+        request);
+
+    profile_record(CALL_IALLGATHERV, sendcount, sendtype, start);
+
+    return err;
+}
+
+int MPI_Scatterv(
+    const void* sendbuf,
+    const int sendcounts[],
+    const int displs[],
+    MPI_Datatype sendtype,
+    void* recvbuf,
+    int recvcount,
+    MPI_Datatype recvtype,
+    int root,
+    MPI_Comm comm) {
+    double start = PMPI_Wtime();
+    int err = PMPI_Scatterv(
+        sendbuf,
+        sendcounts,
+        displs,
+        sendtype,
+        recvbuf,
+        recvcount,
+        recvtype,
+        root,
+        comm);
+
+    profile_record(CALL_SCATTERV, recvcount, recvtype, start);
+
+    return err;
+}
+
+int MPI_Gather(
+    const void* sendbuf,
+    int sendcount,
+    MPI_Datatype sendtype,
+    void* recvbuf,
+    int recvcount,
+    MPI_Datatype recvtype,
+    int root,
+    MPI_Comm comm) {
+    double start = PMPI_Wtime();
+    int err = PMPI_Gather(
+        sendbuf,
+        sendcount,
+        sendtype,
+        recvbuf,
+        recvcount,
+        recvtype,
+        root,
+        comm);
+
+    profile_record(CALL_GATHER, sendcount, sendtype, start);
+
+    return err;
+}
+
+int MPI_Exscan(
+    const void* sendbuf,
+    void* recvbuf,
+    int count,
+    MPI_Datatype datatype,
+    MPI_Op op,
+    MPI_Comm comm) {
+    double start = PMPI_Wtime();
+    int err = PMPI_Exscan(sendbuf, recvbuf, count, datatype, op, comm);
+
+    profile_record(CALL_EXSCAN, count, datatype, start);
+
+    return err;
+}
+
+int MPI_Wait(MPI_Request* request, MPI_Status* status) {
+    double start = PMPI_Wtime();
+    int err = PMPI_Wait(request, status);
+
+    profile_record(CALL_WAIT, 0, MPI_BYTE, start);
+
+    return err;
+}
+
+int MPI_Waitall(int count, MPI_Request requests[], MPI_Status statuses[]) {
+    double start = PMPI_Wtime();
+    int err = PMPI_Waitall(count, requests, statuses);
+
+    profile_record(CALL_WAIT, 0, MPI_BYTE, start);
+
+    return err;
+}
+
+int MPI_File_write_at_all(
+    MPI_File file,
+    MPI_Offset offset,
+    const void* buf,
+    int count,
+    MPI_Datatype datatype,
+    MPI_Status* status) {
+    double start = PMPI_Wtime();
+    int err = PMPI_File_write_at_all(file, offset, buf, count, datatype, status);
+
+    profile_record(CALL_FILE_WRITE, count, datatype, start);
+
+    return err;
+}
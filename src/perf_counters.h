@@ -0,0 +1,102 @@
+#pragma once
+
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/**
+ * Hardware performance counters of this process, read with perf_event_open
+ * (Linux only). The counters are opened with `inherit`, so they include the
+ * threads that are created afterwards: open them before the first OpenMP
+ * parallel region. Counters that the kernel or the CPU does not support (or
+ * that are not permitted, see /proc/sys/kernel/perf_event_paranoid) read as
+ * NaN. Only user-space events are counted.
+ */
+enum perf_counter {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_LLC_MISSES,
+    PERF_DTLB_MISSES,
+    NUM_PERF_COUNTERS
+};
+
+static const char* perf_counter_names[NUM_PERF_COUNTERS] = {
+    "cycles",
+    "instructions",
+    "LLC misses",
+    "dTLB misses",
+};
+
+static int perf_counter_fds[NUM_PERF_COUNTERS] = {-1, -1, -1, -1};
+static bool perf_counters_enabled = false;
+
+/**
+ * Open the counters. Returns false if none of them could be opened.
+ */
+static inline bool perf_counters_open() {
+    const uint32_t types[NUM_PERF_COUNTERS] = {
+        PERF_TYPE_HARDWARE,
+        PERF_TYPE_HARDWARE,
+        PERF_TYPE_HARDWARE,
+        PERF_TYPE_HW_CACHE,
+    };
+    const uint64_t configs[NUM_PERF_COUNTERS] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES,
+        PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+            | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+    };
+
+    for (int i = 0; i < NUM_PERF_COUNTERS; i++) {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = types[i];
+        attr.config = configs[i];
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format =
+            PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        perf_counter_fds[i] = int(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+
+        if (perf_counter_fds[i] < 0) {
+            fprintf(
+                stderr,
+                "warning: hardware counter unavailable: %s (%s)\n",
+                perf_counter_names[i],
+                strerror(errno));
+        } else {
+            perf_counters_enabled = true;
+        }
+    }
+
+    return perf_counters_enabled;
+}
+
+/**
+ * Read the current value of every counter into `values`. If the kernel had
+ * to multiplex the counters, the values are scaled by the fraction of the
+ * time they were running.
+ */
+static inline void perf_counters_read(double* values) {
+    for (int i = 0; i < NUM_PERF_COUNTERS; i++) {
+        uint64_t data[3];  // value, time enabled, time running
+
+        if (perf_counter_fds[i] < 0
+            || read(perf_counter_fds[i], data, sizeof(data)) != ssize_t(sizeof(data))) {
+            values[i] = NAN;
+        } else if (data[2] == 0) {
+            values[i] = 0;
+        } else {
+            values[i] = double(data[0]) * double(data[1]) / double(data[2]);
+        }
+    }
+}
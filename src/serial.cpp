@@ -1,182 +1,239 @@
 #include <chrono>
 #include <iostream>
 
+#include "candidate_kernels.h"
 #include "common.h"
+#include "fused_kernels.h"
+#include "gemm_kernels.h"
+#include "memory.h"
+#include "metrics.h"
+#include "serial_kernels.h"
+#include "sorted_kernels.h"
+#include "timing.h"
 
 /**
- * This function returns a matrix of size (num_row_labels, num_col_labels)
- * that stores the average value for each combination of row label and
- * column label. In other words, the entry at coordinate (x, y) is the
- * average over all input values having row label x and column label y.
+ * The kernels used by the iterations of `cluster_serial`.
  */
-std::vector<float> calculate_cluster_average(
-    int num_rows,
-    int num_cols,
-    int num_row_labels,
-    int num_col_labels,
-    const float* matrix,
-    const label_type* row_labels,
-    const label_type* col_labels) {
-    auto cluster_sum =
-        std::vector<double>(num_row_labels * num_col_labels, 0.0);
-    auto cluster_size = std::vector<int>(num_row_labels * num_col_labels, 0);
-
-    for (int i = 0; i < num_rows; i++) {
-        for (int j = 0; j < num_cols; j++) {
-            auto item = matrix[i * num_cols + j];
-            auto row_label = row_labels[i];
-            auto col_label = col_labels[j];
-
-            cluster_sum[row_label * num_col_labels + col_label] += item;
-            cluster_size[row_label * num_col_labels + col_label] += 1;
-        }
-    }
-
-    auto cluster_avg = std::vector<float>(num_row_labels * num_col_labels);
+enum iteration_kernels {
+    KERNELS_DIRECT,  // serial_kernels.h
+    KERNELS_SORTED,  // sorted_kernels.h, --sort-labels
+    KERNELS_FUSED,  // fused_kernels.h, --fused
+    KERNELS_GEMM,  // gemm_kernels.h, --gemm
+    KERNELS_CANDIDATES,  // candidate_kernels.h, --candidates
+};
 
-    for (int i = 0; i < num_row_labels; i++) {
-        for (int j = 0; j < num_col_labels; j++) {
-            auto index = i * num_col_labels + j;
-            cluster_avg[index] =
-                float(cluster_sum[index]) / float(cluster_size[index]);
-        }
-    }
-
-    return cluster_avg;
-}
-
-float calculate_distance(float avg, float item) {
-    float diff = (avg - item);
-    return diff * diff;
-}
+/**
+ * How `cluster_serial` performs its iterations.
+ */
+struct iteration_options {
+    iteration_kernels kernels = KERNELS_DIRECT;
+    int num_candidates = 0;  // --candidates, for KERNELS_CANDIDATES
+    int sweep_interval = 5;  // --full-sweep, for KERNELS_CANDIDATES
+};
 
 /**
- * Update the labels along the rows of the matrix. This function returns
- * both the number of rows that changed their label and the total distance.
- * If the first return value is zero, then no row was updated.
+ * Perform one iteration of the co-clustering algorithm. This function updates
+ * the labels in both `row_labels` and `col_labels`, and returns the total
+ * number of labels that changed (i.e., the number of rows and columns that
+ * were reassigned to a different label). The number of updates per axis and
+ * the work done are stored in `metrics`. The buffers are taken from
+ * `workspace`, so no memory is allocated.
  */
-std::pair<int, double> update_row_labels(
+template<typename T>
+std::pair<int, double> cluster_serial_iteration(
     int num_rows,
     int num_cols,
     int num_row_labels,
     int num_col_labels,
-    const float* matrix,
+    const T* matrix,
     label_type* row_labels,
-    const label_type* col_labels,
-    const float* cluster_avg) {
-    int num_updated = 0;
-    double total_dist = 0;
+    label_type* col_labels,
+    serial_workspace<T>* workspace,
+    iteration_metrics* metrics) {
+    // Calculate the average value per cluster
+    set_phase(PHASE_CLUSTER_AVERAGE);
+    calculate_cluster_average(
+        num_rows,
+        num_cols,
+        num_row_labels,
+        num_col_labels,
+        matrix,
+        row_labels,
+        col_labels,
+        workspace);
 
-    for (int i = 0; i < num_rows; i++) {
-        int best_label = -1;
-        double best_dist = INFINITY;
+    // Update labels along the rows
+    set_phase(PHASE_ROW_UPDATE);
+    auto [num_rows_updated, _] = update_row_labels(
+        num_rows,
+        num_cols,
+        num_row_labels,
+        num_col_labels,
+        matrix,
+        row_labels,
+        col_labels,
+        workspace->cluster_avg.data());
 
-        for (int k = 0; k < num_row_labels; k++) {
-            double dist = 0;
+    // Update the labels along the columns
+    set_phase(PHASE_COL_UPDATE);
+    auto [num_cols_updated, total_dist] = update_col_labels(
+        num_rows,
+        num_cols,
+        num_col_labels,
+        matrix,
+        row_labels,
+        col_labels,
+        workspace->cluster_avg.data());
 
-            for (int j = 0; j < num_cols; j++) {
-                float item = matrix[i * num_cols + j];
+    set_phase(PHASE_OTHER);
+    metrics->rows_updated = num_rows_updated;
+    metrics->cols_updated = num_cols_updated;
+    metrics->objective = total_dist;
+    metrics->distance_evaluations =
+        double(num_rows) * num_cols * (num_row_labels + num_col_labels);
 
-                int row_label = k;
-                int col_label = col_labels[j];
-                float y = cluster_avg[row_label * num_col_labels + col_label];
+    return {num_rows_updated + num_cols_updated, total_dist};
+}
 
-                dist += calculate_distance(y, item);
-            }
+/**
+ * Perform one iteration of the co-clustering algorithm on a matrix whose rows
+ * and columns are sorted by label, like `cluster_serial_iteration`. The rows
+ * are sorted again after the row update and the columns after the column
+ * update, so that every kernel sees contiguous clusters.
+ */
+template<typename T>
+std::pair<int, double> cluster_sorted_iteration(
+    int num_row_labels,
+    int num_col_labels,
+    sorted_matrix<T>* sorted,
+    serial_workspace<T>* workspace,
+    iteration_metrics* metrics) {
+    // Calculate the average value per cluster
+    set_phase(PHASE_CLUSTER_AVERAGE);
+    calculate_sorted_cluster_average(num_row_labels, num_col_labels, *sorted, workspace);
 
-            if (dist < best_dist) {
-                best_dist = dist;
-                best_label = k;
-            }
-        }
+    // Update labels along the rows
+    set_phase(PHASE_ROW_UPDATE);
+    auto [num_rows_updated, _] = update_sorted_row_labels(
+        num_row_labels,
+        num_col_labels,
+        sorted,
+        workspace->cluster_avg.data());
+    sort_rows(sorted);
 
-        if (row_labels[i] != best_label) {
-            row_labels[i] = best_label;
-            num_updated++;
-        }
+    // Update the labels along the columns
+    set_phase(PHASE_COL_UPDATE);
+    auto [num_cols_updated, total_dist] = update_sorted_col_labels(
+        num_row_labels,
+        num_col_labels,
+        sorted,
+        workspace->cluster_avg.data());
+    sort_cols(sorted);
 
-        total_dist += best_dist;
-    }
+    set_phase(PHASE_OTHER);
+    metrics->rows_updated = num_rows_updated;
+    metrics->cols_updated = num_cols_updated;
+    metrics->objective = total_dist;
+    metrics->distance_evaluations =
+        double(sorted->num_rows) * sorted->num_cols * (num_row_labels + num_col_labels);
 
-    return {num_updated, total_dist};
+    return {num_rows_updated + num_cols_updated, total_dist};
 }
 
 /**
- * Update the labels along the columns of the matrix. This function returns
- * the number of columns that changed their label label and the total distance.
- * If the first return value is zero, then no column was updated.
+ * Perform one iteration of the co-clustering algorithm like
+ * `cluster_serial_iteration`, but with a single pass over the matrix (see
+ * fused_kernels.h). On entry, `workspace->cluster_avg` holds the cluster
+ * averages of the current labels. On return, it holds those of the updated
+ * labels, ready for the next iteration.
  */
-std::pair<int, double> update_col_labels(
+template<typename T>
+std::pair<int, double> cluster_fused_iteration(
     int num_rows,
     int num_cols,
+    int num_row_labels,
     int num_col_labels,
-    const float* matrix,
-    const label_type* row_labels,
+    const T* matrix,
+    label_type* row_labels,
     label_type* col_labels,
-    const float* cluster_avg) {
-    int num_updated = 0;
-    double total_dist = 0;
-
-    for (int j = 0; j < num_cols; j++) {
-        int best_label = -1;
-        double best_dist = INFINITY;
-
-        for (int k = 0; k < num_col_labels; k++) {
-            double dist = 0;
-
-            for (int i = 0; i < num_rows; i++) {
-                auto item = matrix[i * num_cols + j];
-
-                auto row_label = row_labels[i];
-                auto col_label = k;
-                auto y = cluster_avg[row_label * num_col_labels + col_label];
-
-                dist += calculate_distance(y, item);
-            }
+    serial_workspace<T>* workspace,
+    fused_workspace* fused,
+    iteration_metrics* metrics) {
+    // Update labels along the rows, accumulating the column statistics
+    set_phase(PHASE_ROW_UPDATE);
+    auto [num_rows_updated, _] = update_fused_row_labels(
+        num_rows,
+        num_cols,
+        num_row_labels,
+        num_col_labels,
+        matrix,
+        row_labels,
+        col_labels,
+        workspace->cluster_avg.data(),
+        fused);
 
-            if (dist < best_dist) {
-                best_dist = dist;
-                best_label = k;
-            }
-        }
+    // Update the labels along the columns from these statistics
+    set_phase(PHASE_COL_UPDATE);
+    auto [num_cols_updated, total_dist] = update_fused_col_labels<T>(
+        num_cols,
+        num_row_labels,
+        num_col_labels,
+        col_labels,
+        workspace->cluster_avg.data(),
+        *fused);
 
-        if (col_labels[j] != best_label) {
-            col_labels[j] = best_label;
-            num_updated++;
-        }
+    // Calculate the average value per cluster for the next iteration
+    set_phase(PHASE_CLUSTER_AVERAGE);
+    calculate_fused_cluster_average(
+        num_cols,
+        num_row_labels,
+        num_col_labels,
+        col_labels,
+        *fused,
+        workspace);
 
-        total_dist += best_dist;
-    }
+    set_phase(PHASE_OTHER);
+    metrics->rows_updated = num_rows_updated;
+    metrics->cols_updated = num_cols_updated;
+    metrics->objective = total_dist;
+    metrics->distance_evaluations =
+        double(num_rows) * num_cols * (num_row_labels + num_col_labels);
 
-    return {num_updated, total_dist};
+    return {num_rows_updated + num_cols_updated, total_dist};
 }
 
 /**
- * Perform one iteration of the co-clustering algorithm. This function updates
- * the labels in both `row_labels` and `col_labels`, and returns the total
- * number of labels that changed (i.e., the number of rows and columns that
- * were reassigned to a different label).
+ * Perform one iteration of the co-clustering algorithm like
+ * `cluster_serial_iteration`, but with the label updates computed as matrix
+ * multiplications (see gemm_kernels.h).
  */
-std::pair<int, double> cluster_serial_iteration(
+template<typename T>
+std::pair<int, double> cluster_gemm_iteration(
     int num_rows,
     int num_cols,
     int num_row_labels,
     int num_col_labels,
-    const float* matrix,
+    const T* matrix,
     label_type* row_labels,
-    label_type* col_labels) {
+    label_type* col_labels,
+    serial_workspace<T>* workspace,
+    gemm_workspace* gemm,
+    iteration_metrics* metrics) {
     // Calculate the average value per cluster
-    auto cluster_avg = calculate_cluster_average(
+    set_phase(PHASE_CLUSTER_AVERAGE);
+    calculate_cluster_average(
         num_rows,
         num_cols,
         num_row_labels,
         num_col_labels,
         matrix,
         row_labels,
-        col_labels);
+        col_labels,
+        workspace);
 
     // Update labels along the rows
-    auto [num_rows_updated, _] = update_row_labels(
+    set_phase(PHASE_ROW_UPDATE);
+    auto [num_rows_updated, _] = update_row_labels_gemm(
         num_rows,
         num_cols,
         num_row_labels,
@@ -184,17 +241,138 @@ std::pair<int, double> cluster_serial_iteration(
         matrix,
         row_labels,
         col_labels,
-        cluster_avg.data());
+        workspace->cluster_avg.data(),
+        gemm);
 
     // Update the labels along the columns
-    auto [num_cols_updated, total_dist] = update_col_labels(
+    set_phase(PHASE_COL_UPDATE);
+    auto [num_cols_updated, total_dist] = update_col_labels_gemm(
         num_rows,
         num_cols,
+        num_row_labels,
         num_col_labels,
         matrix,
         row_labels,
         col_labels,
-        cluster_avg.data());
+        workspace->cluster_avg.data(),
+        gemm);
+
+    set_phase(PHASE_OTHER);
+    metrics->rows_updated = num_rows_updated;
+    metrics->cols_updated = num_cols_updated;
+    metrics->objective = total_dist;
+    metrics->distance_evaluations =
+        double(num_rows) * num_cols * (num_row_labels + num_col_labels);
+
+    return {num_rows_updated + num_cols_updated, total_dist};
+}
+
+/**
+ * Perform one iteration of the co-clustering algorithm like
+ * `cluster_serial_iteration`, but as a full sweep that records the closest
+ * labels of every row and column in `candidates`, or only evaluating those
+ * (see candidate_kernels.h). The choice is made by
+ * `begin_candidate_iteration`.
+ */
+template<typename T>
+std::pair<int, double> cluster_candidate_iteration(
+    int num_rows,
+    int num_cols,
+    int num_row_labels,
+    int num_col_labels,
+    const T* matrix,
+    label_type* row_labels,
+    label_type* col_labels,
+    serial_workspace<T>* workspace,
+    candidate_workspace* candidates,
+    iteration_metrics* metrics) {
+    int num_row_candidates = candidates->num_row_candidates;
+    int num_col_candidates = candidates->num_col_candidates;
+    begin_candidate_iteration(candidates);
+
+    // Calculate the average value per cluster
+    set_phase(PHASE_CLUSTER_AVERAGE);
+    calculate_cluster_average(
+        num_rows,
+        num_cols,
+        num_row_labels,
+        num_col_labels,
+        matrix,
+        row_labels,
+        col_labels,
+        workspace);
+
+    int num_rows_updated, num_cols_updated;
+    double total_dist;
+
+    if (candidates->full_sweep) {
+        // Update labels along the rows
+        set_phase(PHASE_ROW_UPDATE);
+        num_rows_updated = update_row_labels(
+            num_rows,
+            num_cols,
+            num_row_labels,
+            num_col_labels,
+            matrix,
+            row_labels,
+            col_labels,
+            workspace->cluster_avg.data(),
+            candidates->row_candidates.data(),
+            candidates->row_candidate_dist.data(),
+            num_row_candidates).first;
+
+        // Update the labels along the columns
+        set_phase(PHASE_COL_UPDATE);
+        std::tie(num_cols_updated, total_dist) = update_col_labels(
+            num_rows,
+            num_cols,
+            num_col_labels,
+            matrix,
+            row_labels,
+            col_labels,
+            workspace->cluster_avg.data(),
+            candidates->col_candidates.data(),
+            candidates->col_candidate_dist.data(),
+            num_col_candidates);
+
+        metrics->distance_evaluations =
+            double(num_rows) * num_cols * (num_row_labels + num_col_labels);
+    } else {
+        // Update labels along the rows
+        set_phase(PHASE_ROW_UPDATE);
+        num_rows_updated = update_row_labels_restricted(
+            num_rows,
+            num_cols,
+            num_col_labels,
+            matrix,
+            row_labels,
+            col_labels,
+            workspace->cluster_avg.data(),
+            candidates->row_candidates.data(),
+            num_row_candidates).first;
+
+        // Update the labels along the columns
+        set_phase(PHASE_COL_UPDATE);
+        std::tie(num_cols_updated, total_dist) = update_col_labels_restricted(
+            num_rows,
+            num_cols,
+            num_col_labels,
+            matrix,
+            row_labels,
+            col_labels,
+            workspace->cluster_avg.data(),
+            candidates->col_candidates.data(),
+            num_col_candidates);
+
+        metrics->distance_evaluations =
+            double(num_rows) * num_cols * (num_row_candidates + num_col_candidates);
+    }
+
+    set_phase(PHASE_OTHER);
+    metrics->rows_updated = num_rows_updated;
+    metrics->cols_updated = num_cols_updated;
+    metrics->objective = total_dist;
+    end_candidate_iteration(num_rows_updated + num_cols_updated, total_dist, candidates);
 
     return {num_rows_updated + num_cols_updated, total_dist};
 }
@@ -202,38 +380,145 @@ std::pair<int, double> cluster_serial_iteration(
 /**
  * Repeatedly calls `cluster_serial_iteration` to iteratively update the
  * labels along the rows and columns. This function performs
- * `max_iterations` iterations or until convergence.
+ * `max_iterations` iterations or until convergence. The matrix elements are
+ * of type T, which depends on the storage strategy (see memory.h).
+ *
+ * The iteration function is selected by `options.kernels`. For
+ * KERNELS_SORTED, `sorted` must be given, and `matrix` and the labels are
+ * taken from it.
  */
+template<typename T>
 void cluster_serial(
     int num_rows,
     int num_cols,
     int num_row_labels,
     int num_col_labels,
-    float* matrix,
+    const T* matrix,
     label_type* row_labels,
     label_type* col_labels,
-    int max_iterations = 25) {
+    int max_iterations = 25,
+    const iteration_options& options = iteration_options(),
+    sorted_matrix<T>* sorted = nullptr) {
     int iteration = 0;
     auto before = std::chrono::high_resolution_clock::now();
+    auto workspace = serial_workspace<T>(num_row_labels, num_col_labels);
+    iteration_kernels kernels = options.kernels;
+    fused_workspace fused_buffers;
+    gemm_workspace gemm_buffers;
+    candidate_workspace candidate_buffers;
+
+    if (kernels == KERNELS_GEMM) {
+        resize_gemm_workspace(num_row_labels, num_col_labels, &gemm_buffers);
+    }
 
-    while (iteration < max_iterations) {
-        auto [num_updated, total_dist] = cluster_serial_iteration(
+    if (kernels == KERNELS_CANDIDATES) {
+        resize_candidate_workspace(
+            num_rows,
+            num_cols,
+            num_row_labels,
+            num_col_labels,
+            options.num_candidates,
+            options.sweep_interval,
+            &candidate_buffers);
+    }
+
+    // The fused iterations calculate the cluster averages of the next
+    // iteration, so those of the first iteration are calculated here
+    if (kernels == KERNELS_FUSED) {
+        resize_fused_workspace(num_cols, num_row_labels, num_col_labels, &fused_buffers);
+        set_phase(PHASE_CLUSTER_AVERAGE);
+        calculate_cluster_average(
             num_rows,
             num_cols,
             num_row_labels,
             num_col_labels,
             matrix,
             row_labels,
-            col_labels);
+            col_labels,
+            &workspace);
+        set_phase(PHASE_OTHER);
+    }
+
+    while (iteration < max_iterations) {
+        TRACE_SCOPE("iteration", "iteration");
+        iteration_metrics metrics;
+        metrics_begin_iteration();
+        long allocations = heap_allocation_count();
+
+        int num_updated;
+        double total_dist;
+
+        if (kernels == KERNELS_SORTED) {
+            std::tie(num_updated, total_dist) = cluster_sorted_iteration(
+                num_row_labels,
+                num_col_labels,
+                sorted,
+                &workspace,
+                &metrics);
+        } else if (kernels == KERNELS_FUSED) {
+            std::tie(num_updated, total_dist) = cluster_fused_iteration(
+                num_rows,
+                num_cols,
+                num_row_labels,
+                num_col_labels,
+                matrix,
+                row_labels,
+                col_labels,
+                &workspace,
+                &fused_buffers,
+                &metrics);
+        } else if (kernels == KERNELS_GEMM) {
+            std::tie(num_updated, total_dist) = cluster_gemm_iteration(
+                num_rows,
+                num_cols,
+                num_row_labels,
+                num_col_labels,
+                matrix,
+                row_labels,
+                col_labels,
+                &workspace,
+                &gemm_buffers,
+                &metrics);
+        } else if (kernels == KERNELS_CANDIDATES) {
+            std::tie(num_updated, total_dist) = cluster_candidate_iteration(
+                num_rows,
+                num_cols,
+                num_row_labels,
+                num_col_labels,
+                matrix,
+                row_labels,
+                col_labels,
+                &workspace,
+                &candidate_buffers,
+                &metrics);
+        } else {
+            std::tie(num_updated, total_dist) = cluster_serial_iteration(
+                num_rows,
+                num_cols,
+                num_row_labels,
+                num_col_labels,
+                matrix,
+                row_labels,
+                col_labels,
+                &workspace,
+                &metrics);
+        }
+
+        if (iteration > 0) {
+            check_no_allocations(allocations, "cluster_serial_iteration");
+        }
 
         iteration++;
+        metrics_end_iteration(iteration, double(num_rows) * num_cols, metrics);
 
-        auto average_dist = total_dist / (num_rows * num_cols);
+        auto average_dist = total_dist / (double(num_rows) * num_cols);
         std::cout << "iteration " << iteration << ": " << num_updated
                   << " labels were updated, average error is " << average_dist
                   << "\n";
 
-        if (num_updated == 0) {
+        // A restricted iteration that updates no labels is followed by a
+        // full sweep, which decides on convergence
+        if (num_updated == 0 && (kernels != KERNELS_CANDIDATES || candidate_buffers.full_sweep)) {
             break;
         }
     }
@@ -244,11 +529,100 @@ void cluster_serial(
     std::cout << "clustering time total: " << time_seconds << " seconds\n";
     std::cout << "clustering time per iteration: " << (time_seconds / iteration)
               << " seconds\n";
+    print_phase_times();
+    print_phase_counters(phase_counters, double(num_rows) * num_cols * iteration);
+}
+
+/**
+ * Run `cluster_serial` on `matrix` with the given options. For
+ * KERNELS_SORTED, the rows and columns of `matrix` are first sorted by label
+ * in place (see sorted_kernels.h), and the resulting labels are mapped back
+ * to the original order.
+ */
+template<typename T>
+void cluster_matrix(
+    int num_rows,
+    int num_cols,
+    int num_row_labels,
+    int num_col_labels,
+    T* matrix,
+    label_type* row_labels,
+    label_type* col_labels,
+    int max_iterations,
+    const iteration_options& options) {
+    if (options.kernels != KERNELS_SORTED) {
+        cluster_serial(
+            num_rows,
+            num_cols,
+            num_row_labels,
+            num_col_labels,
+            matrix,
+            row_labels,
+            col_labels,
+            max_iterations,
+            options);
+        return;
+    }
+
+    sorted_matrix<T> sorted;
+    init_sorted_matrix(
+        num_rows,
+        num_cols,
+        num_row_labels,
+        num_col_labels,
+        matrix,
+        row_labels,
+        col_labels,
+        &sorted);
+
+    cluster_serial(
+        num_rows,
+        num_cols,
+        num_row_labels,
+        num_col_labels,
+        sorted.matrix,
+        row_labels,
+        col_labels,
+        max_iterations,
+        options,
+        &sorted);
+
+    restore_labels(sorted, row_labels, col_labels);
+}
+
+/**
+ * Estimate the memory of the buffers that `options` needs in addition to
+ * `estimate_buffer_bytes`.
+ */
+static double estimate_workspace_bytes(
+    const iteration_options& options,
+    int num_rows,
+    int num_cols,
+    int num_row_labels,
+    int num_col_labels) {
+    switch (options.kernels) {
+        case KERNELS_SORTED:
+            // The row buffer is counted as float, the larger element type
+            return estimate_sorted_workspace_bytes<float>(num_rows, num_cols, num_row_labels, num_col_labels);
+        case KERNELS_FUSED:
+            return estimate_fused_workspace_bytes(num_cols, num_row_labels, num_col_labels);
+        case KERNELS_GEMM:
+            return estimate_gemm_workspace_bytes(num_row_labels, num_col_labels);
+        case KERNELS_CANDIDATES:
+            return estimate_candidate_workspace_bytes(
+                num_rows,
+                num_cols,
+                num_row_labels,
+                num_col_labels,
+                options.num_candidates);
+        default:
+            return 0;
+    }
 }
 
 int main(int argc, const char* argv[]) {
-    std::string output_file;
-    std::vector<float> matrix;
+    std::string input_file, output_file;
+    std::vector<float> unused_matrix;
     std::vector<label_type> row_labels, col_labels;
     int num_rows = 0, num_cols = 0;
     int num_row_labels = 0, num_col_labels = 0;
@@ -257,44 +631,208 @@ int main(int argc, const char* argv[]) {
     auto before = std::chrono::high_resolution_clock::now();
 
     // Parse arguments
+    auto program = create_argument_parser(argv[0]);
+    program.add_argument("--sort-labels")
+        .help("Sort the rows and columns of the matrix by label, so that every cluster is contiguous")
+        .default_value(false)
+        .implicit_value(true);
+    program.add_argument("--fused")
+        .help("Update the labels and cluster averages with a single pass over the matrix per iteration")
+        .default_value(false)
+        .implicit_value(true);
+    program.add_argument("--gemm")
+        .help("Compute the label updates as matrix multiplications, which is faster for many labels")
+        .default_value(false)
+        .implicit_value(true);
+    program.add_argument("--candidates")
+        .scan<'i', int>()
+        .help("Only evaluate the given number of closest labels of every row and column "
+              "between full sweeps over all labels")
+        .default_value(0);
+    program.add_argument("--full-sweep")
+        .scan<'i', int>()
+        .help("With --candidates, perform a full sweep at least every given number of iterations")
+        .default_value(5);
+
     if (!parse_arguments(
+            program,
             argc,
             argv,
             &num_rows,
             &num_cols,
             &num_row_labels,
             &num_col_labels,
-            &matrix,
+            &unused_matrix,
             &row_labels,
             &col_labels,
             &output_file,
-            &max_iter)) {
+            &max_iter,
+            &input_file)) {
+        return EXIT_FAILURE;
+    }
+
+    memory_track(MEMORY_LABELS, double(num_rows + num_cols) * sizeof(label_type));
+
+    iteration_options options;
+    const char* exclusive_error =
+        "error: only one of --sort-labels, --fused, --gemm and --candidates can be given\n";
+    const char* kernel_options[] = {"--sort-labels", "--fused", "--gemm"};
+    const iteration_kernels kernel_values[] = {
+        KERNELS_SORTED,
+        KERNELS_FUSED,
+        KERNELS_GEMM,
+    };
+
+    for (int i = 0; i < 3; i++) {
+        if (!program.get<bool>(kernel_options[i])) {
+            continue;
+        }
+
+        if (options.kernels != KERNELS_DIRECT) {
+            fprintf(stderr, "%s", exclusive_error);
+            return EXIT_FAILURE;
+        }
+
+        options.kernels = kernel_values[i];
+    }
+
+    options.num_candidates = program.get<int>("--candidates");
+    options.sweep_interval = program.get<int>("--full-sweep");
+
+    if (options.num_candidates < 0 || options.num_candidates > max_candidates) {
+        fprintf(stderr, "error: --candidates must be between 0 and %d\n", max_candidates);
+        return EXIT_FAILURE;
+    }
+
+    if (options.sweep_interval < 1) {
+        fprintf(stderr, "error: --full-sweep must be at least 1\n");
+        return EXIT_FAILURE;
+    }
+
+    if (options.num_candidates > 0) {
+        if (options.kernels != KERNELS_DIRECT) {
+            fprintf(stderr, "%s", exclusive_error);
+            return EXIT_FAILURE;
+        }
+
+        options.kernels = KERNELS_CANDIDATES;
+    }
+
+    // Select how to store the matrix before loading it
+    double memory_limit = 0;
+    matrix_strategy strategy;
+    std::string memory_limit_text = program.get("--memory-limit");
+
+    if ((!memory_limit_text.empty() && !parse_memory_size(memory_limit_text, &memory_limit))
+        || !select_matrix_strategy(
+            memory_limit,
+            double(num_rows) * num_cols,
+            1,
+            estimate_buffer_bytes(num_rows, num_cols, num_row_labels, num_col_labels)
+                + estimate_workspace_bytes(options, num_rows, num_cols, num_row_labels, num_col_labels),
+            &strategy)) {
+        return EXIT_FAILURE;
+    }
+
+    fprintf(stderr, " * matrix storage: %s\n", matrix_strategy_name(strategy));
+
+    // Sorting permutes the matrix in place, which the read-only mapping of
+    // the out-of-core strategy does not allow
+    if (options.kernels == KERNELS_SORTED && strategy == STRATEGY_OUT_OF_CORE) {
+        fprintf(stderr, "error: --sort-labels requires the matrix to fit in memory\n");
+        return EXIT_FAILURE;
+    }
+
+    matrix_storage matrix;
+
+    if (!load_matrix(input_file, num_rows, num_cols, strategy, &matrix)) {
+        return EXIT_FAILURE;
+    }
+
+    io_seconds += std::chrono::duration<double>(
+        std::chrono::high_resolution_clock::now() - before).count();
+
+    // The input has already been read, so it is recorded afterwards
+    std::string trace_file = program.get("--trace");
+
+    if (!trace_file.empty()) {
+        trace_enable(before);
+        trace_record("read_input", "io", 0, io_seconds);
+    }
+
+    std::string metrics_file = program.get("--metrics");
+
+    if (!metrics_file.empty() && !metrics_open(metrics_file)) {
         return EXIT_FAILURE;
     }
 
+    if (program.get<bool>("--counters")) {
+        enable_phase_counters();
+    }
+
     // Cluster labels
-    cluster_serial(
-        num_rows,
-        num_cols,
-        num_row_labels,
-        num_col_labels,
-        matrix.data(),
-        row_labels.data(),
-        col_labels.data(),
-        max_iter);
+    if (strategy == STRATEGY_REDUCED_PRECISION) {
+        cluster_matrix(
+            num_rows,
+            num_cols,
+            num_row_labels,
+            num_col_labels,
+            matrix.reduced_values.data(),
+            row_labels.data(),
+            col_labels.data(),
+            max_iter,
+            options);
+    } else if (strategy == STRATEGY_IN_MEMORY) {
+        cluster_matrix(
+            num_rows,
+            num_cols,
+            num_row_labels,
+            num_col_labels,
+            matrix.values.data(),
+            row_labels.data(),
+            col_labels.data(),
+            max_iter,
+            options);
+    } else {
+        cluster_serial(
+            num_rows,
+            num_cols,
+            num_row_labels,
+            num_col_labels,
+            matrix.mapped_values,
+            row_labels.data(),
+            col_labels.data(),
+            max_iter,
+            options);
+    }
+
+    double memory_usage[NUM_MEMORY_COMPONENTS + 2];
+    memory_peaks(memory_usage);
+    print_memory_usage(memory_usage);
+    unload_matrix(&matrix);
 
     // Write resulting labels
-    write_labels(
-        output_file,
-        num_rows,
-        num_cols,
-        row_labels.data(),
-        col_labels.data());
+    auto write_before = std::chrono::high_resolution_clock::now();
+    {
+        TRACE_SCOPE("write_labels", "io");
+        write_labels(
+            output_file,
+            num_rows,
+            num_cols,
+            row_labels.data(),
+            col_labels.data());
+    }
 
     auto after = std::chrono::high_resolution_clock::now();
     auto time_seconds = std::chrono::duration<double>(after - before).count();
+    io_seconds += std::chrono::duration<double>(after - write_before).count();
 
     std::cout << "total execution time: " << time_seconds << " seconds\n";
+    metrics_close(time_seconds);
+
+    if (!trace_file.empty() && !trace_write(trace_file, trace_serialize(0))) {
+        return EXIT_FAILURE;
+    }
 
     return EXIT_SUCCESS;
 }
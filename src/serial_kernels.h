@@ -0,0 +1,340 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+#include <vector>
+
+#include "common.h"
+#include "memory.h"
+
+/*
+ * The kernels of the serial implementation. They are templated on the element
+ * type of the matrix, so that the kernel benchmarks (bench.cpp) can also
+ * measure them for other data types; cgc_serial uses float, or bfloat16 for
+ * the reduced-precision strategy (see memory.h). Arithmetic is done in
+ * `compute_type<T>::type`.
+ */
+
+template<typename T>
+using cluster_vector = tracked_vector<typename compute_type<T>::type, MEMORY_CLUSTERS>;
+
+/**
+ * The buffers of an iteration. They are allocated once per run, so that the
+ * iterations themselves do not allocate memory.
+ */
+template<typename T>
+struct serial_workspace {
+    tracked_vector<double, MEMORY_CLUSTERS> cluster_sum;
+    tracked_vector<index_type, MEMORY_CLUSTERS> cluster_size;
+    cluster_vector<T> cluster_avg;
+
+    serial_workspace(int num_row_labels, int num_col_labels) :
+        cluster_sum(num_row_labels * num_col_labels),
+        cluster_size(num_row_labels * num_col_labels),
+        cluster_avg(num_row_labels * num_col_labels) {}
+};
+
+/**
+ * This function calculates a matrix of size (num_row_labels, num_col_labels)
+ * that stores the average value for each combination of row label and
+ * column label. In other words, the entry at coordinate (x, y) is the
+ * average over all input values having row label x and column label y.
+ * The result is stored in `workspace->cluster_avg`.
+ */
+template<typename T>
+static void calculate_cluster_average(
+    int num_rows,
+    int num_cols,
+    int num_row_labels,
+    int num_col_labels,
+    const T* matrix,
+    const label_type* row_labels,
+    const label_type* col_labels,
+    serial_workspace<T>* workspace) {
+    using C = typename compute_type<T>::type;
+    auto& cluster_sum = workspace->cluster_sum;
+    auto& cluster_size = workspace->cluster_size;
+    auto& cluster_avg = workspace->cluster_avg;
+
+    std::fill(cluster_sum.begin(), cluster_sum.end(), 0.0);
+    std::fill(cluster_size.begin(), cluster_size.end(), 0);
+
+    for (int i = 0; i < num_rows; i++) {
+        for (int j = 0; j < num_cols; j++) {
+            C item = matrix[index_type(i) * num_cols + j];
+            auto row_label = row_labels[i];
+            auto col_label = col_labels[j];
+
+            cluster_sum[row_label * num_col_labels + col_label] += item;
+            cluster_size[row_label * num_col_labels + col_label] += 1;
+        }
+    }
+
+    for (int i = 0; i < num_row_labels; i++) {
+        for (int j = 0; j < num_col_labels; j++) {
+            auto index = i * num_col_labels + j;
+            cluster_avg[index] =
+                C(cluster_sum[index]) / C(cluster_size[index]);
+        }
+    }
+}
+
+template<typename T>
+static inline T calculate_distance(T avg, T item) {
+    T diff = (avg - item);
+    return diff * diff;
+}
+
+/**
+ * Insert `label` at distance `dist` into the `num_top` closest labels of an
+ * item, which are kept in `top_labels` and `top_dist` sorted by distance. Of
+ * labels at the same distance, the one inserted first stays in front. Labels
+ * at a NaN distance are skipped.
+ */
+static inline void insert_top_label(
+    int num_top,
+    label_type* top_labels,
+    double* top_dist,
+    int label,
+    double dist) {
+    if (!(dist < top_dist[num_top - 1])) {
+        return;
+    }
+
+    int n = num_top - 1;
+
+    while (n > 0 && dist < top_dist[n - 1]) {
+        top_labels[n] = top_labels[n - 1];
+        top_dist[n] = top_dist[n - 1];
+        n--;
+    }
+
+    top_labels[n] = label;
+    top_dist[n] = dist;
+}
+
+/**
+ * Update the labels along the rows of the matrix. This function returns
+ * both the number of rows that changed their label and the total distance.
+ * If the first return value is zero, then no row was updated.
+ *
+ * The rows are processed in blocks, and the row labels in tiles: for every
+ * block of columns, the averages of the tile are gathered into `panel`, which
+ * stays in cache while it is applied to all rows of the block. The best label
+ * of every row is carried over from one tile to the next. The distances are
+ * summed in the same order as without tiling, so the results are identical.
+ *
+ * If `top_labels` is given, the `num_top` closest labels of every row are
+ * stored in it, and their distances in `top_dist`, both of size
+ * (num_rows, num_top), see `insert_top_label`. Unused entries are -1.
+ */
+template<typename T>
+static std::pair<int, double> update_row_labels(
+    int num_rows,
+    int num_cols,
+    int num_row_labels,
+    int num_col_labels,
+    const T* matrix,
+    label_type* row_labels,
+    const label_type* col_labels,
+    const typename compute_type<T>::type* cluster_avg,
+    label_type* top_labels = nullptr,
+    double* top_dist = nullptr,
+    int num_top = 0) {
+    using C = typename compute_type<T>::type;
+    const int block_rows = 16;
+    const int block_cols = 256;
+    const int tile_labels = 32;
+    C panel[block_cols * tile_labels];
+    double dist[block_rows * tile_labels];
+    double best_dist[block_rows];
+    int best_label[block_rows];
+    int num_updated = 0;
+    double total_dist = 0;
+
+    for (int row_begin = 0; row_begin < num_rows; row_begin += block_rows) {
+        int num_block_rows = std::min(block_rows, num_rows - row_begin);
+
+        std::fill(best_dist, best_dist + num_block_rows, INFINITY);
+        std::fill(best_label, best_label + num_block_rows, -1);
+
+        if (top_labels != nullptr) {
+            index_type top_begin = index_type(row_begin) * num_top;
+            std::fill_n(&top_labels[top_begin], num_block_rows * num_top, -1);
+            std::fill_n(&top_dist[top_begin], num_block_rows * num_top, INFINITY);
+        }
+
+        for (int label_begin = 0; label_begin < num_row_labels; label_begin += tile_labels) {
+            int num_tile_labels = std::min(tile_labels, num_row_labels - label_begin);
+
+            std::fill(dist, dist + num_block_rows * tile_labels, 0.0);
+
+            for (int col_begin = 0; col_begin < num_cols; col_begin += block_cols) {
+                int num_block_cols = std::min(block_cols, num_cols - col_begin);
+
+                // panel[j, k] = cluster_avg[label_begin + k, col_labels[col_begin + j]]
+                for (int j = 0; j < num_block_cols; j++) {
+                    const C* avg = &cluster_avg[label_begin * num_col_labels + col_labels[col_begin + j]];
+
+                    for (int k = 0; k < num_tile_labels; k++) {
+                        panel[j * tile_labels + k] = avg[k * num_col_labels];
+                    }
+                }
+
+                for (int i = 0; i < num_block_rows; i++) {
+                    const T* row = &matrix[index_type(row_begin + i) * num_cols + col_begin];
+                    double* row_dist = &dist[i * tile_labels];
+
+                    for (int j = 0; j < num_block_cols; j++) {
+                        C item = row[j];
+                        const C* y = &panel[j * tile_labels];
+
+                        for (int k = 0; k < num_tile_labels; k++) {
+                            row_dist[k] += calculate_distance(y[k], item);
+                        }
+                    }
+                }
+            }
+
+            for (int i = 0; i < num_block_rows; i++) {
+                for (int k = 0; k < num_tile_labels; k++) {
+                    if (dist[i * tile_labels + k] < best_dist[i]) {
+                        best_dist[i] = dist[i * tile_labels + k];
+                        best_label[i] = label_begin + k;
+                    }
+                }
+            }
+
+            if (top_labels != nullptr) {
+                for (int i = 0; i < num_block_rows; i++) {
+                    index_type top_begin = index_type(row_begin + i) * num_top;
+
+                    for (int k = 0; k < num_tile_labels; k++) {
+                        insert_top_label(
+                            num_top,
+                            &top_labels[top_begin],
+                            &top_dist[top_begin],
+                            label_begin + k,
+                            dist[i * tile_labels + k]);
+                    }
+                }
+            }
+        }
+
+        for (int i = 0; i < num_block_rows; i++) {
+            if (row_labels[row_begin + i] != best_label[i]) {
+                row_labels[row_begin + i] = best_label[i];
+                num_updated++;
+            }
+
+            total_dist += best_dist[i];
+        }
+    }
+
+    return {num_updated, total_dist};
+}
+
+/**
+ * Update the labels along the columns of the matrix. This function returns
+ * the number of columns that changed their label label and the total distance.
+ * If the first return value is zero, then no column was updated.
+ *
+ * The columns are processed in blocks, and the column labels in tiles: every
+ * tile reads the block of columns row by row, and only the averages of the
+ * tile are used, so that they stay in cache. The best label of every column
+ * is carried over from one tile to the next. The distances are summed in the
+ * same order as without tiling, so the results are identical.
+ *
+ * If `top_labels` is given, the `num_top` closest labels of every column are
+ * stored in it, like by `update_row_labels`.
+ */
+template<typename T>
+static std::pair<int, double> update_col_labels(
+    int num_rows,
+    int num_cols,
+    int num_col_labels,
+    const T* matrix,
+    const label_type* row_labels,
+    label_type* col_labels,
+    const typename compute_type<T>::type* cluster_avg,
+    label_type* top_labels = nullptr,
+    double* top_dist = nullptr,
+    int num_top = 0) {
+    using C = typename compute_type<T>::type;
+    const int block_cols = 128;
+    const int tile_labels = 32;
+    double dist[tile_labels * block_cols];
+    double best_dist[block_cols];
+    int best_label[block_cols];
+    int num_updated = 0;
+    double total_dist = 0;
+
+    for (int col_begin = 0; col_begin < num_cols; col_begin += block_cols) {
+        int num_block_cols = std::min(block_cols, num_cols - col_begin);
+
+        std::fill(best_dist, best_dist + num_block_cols, INFINITY);
+        std::fill(best_label, best_label + num_block_cols, -1);
+
+        if (top_labels != nullptr) {
+            index_type top_begin = index_type(col_begin) * num_top;
+            std::fill_n(&top_labels[top_begin], num_block_cols * num_top, -1);
+            std::fill_n(&top_dist[top_begin], num_block_cols * num_top, INFINITY);
+        }
+
+        for (int label_begin = 0; label_begin < num_col_labels; label_begin += tile_labels) {
+            int num_tile_labels = std::min(tile_labels, num_col_labels - label_begin);
+
+            std::fill(dist, dist + tile_labels * block_cols, 0.0);
+
+            for (int i = 0; i < num_rows; i++) {
+                const T* row = &matrix[index_type(i) * num_cols + col_begin];
+                const C* avg = &cluster_avg[row_labels[i] * num_col_labels + label_begin];
+
+                for (int k = 0; k < num_tile_labels; k++) {
+                    C y = avg[k];
+                    double* label_dist = &dist[k * block_cols];
+
+                    for (int j = 0; j < num_block_cols; j++) {
+                        label_dist[j] += calculate_distance(y, C(row[j]));
+                    }
+                }
+            }
+
+            for (int k = 0; k < num_tile_labels; k++) {
+                for (int j = 0; j < num_block_cols; j++) {
+                    if (dist[k * block_cols + j] < best_dist[j]) {
+                        best_dist[j] = dist[k * block_cols + j];
+                        best_label[j] = label_begin + k;
+                    }
+                }
+            }
+
+            if (top_labels != nullptr) {
+                for (int j = 0; j < num_block_cols; j++) {
+                    index_type top_begin = index_type(col_begin + j) * num_top;
+
+                    for (int k = 0; k < num_tile_labels; k++) {
+                        insert_top_label(
+                            num_top,
+                            &top_labels[top_begin],
+                            &top_dist[top_begin],
+                            label_begin + k,
+                            dist[k * block_cols + j]);
+                    }
+                }
+            }
+        }
+
+        for (int j = 0; j < num_block_cols; j++) {
+            if (col_labels[col_begin + j] != best_label[j]) {
+                col_labels[col_begin + j] = best_label[j];
+                num_updated++;
+            }
+
+            total_dist += best_dist[j];
+        }
+    }
+
+    return {num_updated, total_dist};
+}
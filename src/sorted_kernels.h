@@ -0,0 +1,604 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdlib>
+#include <numeric>
+#include <utility>
+
+#include "common.h"
+#include "memory.h"
+#include "serial_kernels.h"
+
+/*
+ * The kernels of the serial implementation for a matrix whose rows and
+ * columns are sorted by label (`cgc_serial --sort-labels`). Every cluster is
+ * then a contiguous block of the matrix, so the kernels loop over blocks
+ * instead of looking up the label of every element. The matrix is permuted in
+ * place, and the permutation is updated whenever labels change.
+ *
+ * The label updates sum every row (column) per block of columns (rows), and
+ * compute the distances from these sums by expanding
+ * sum (a - x)^2 = sum x^2 - 2 a sum x + n a^2, like the fused iteration (see
+ * fused_kernels.h). This reads the matrix once per update instead of once per
+ * label, but rounds differently than the direct distances, so labels that are
+ * (nearly) tied can be resolved differently than by the other kernels.
+ */
+
+/**
+ * The order of the rows (or columns) of a sorted matrix. Position `p` holds
+ * item `order[p]` of the input, which has label `labels[p]`, and item `i` is
+ * at position `position[i]`. The items with label `k` are at the positions
+ * from `offsets[k]` up to `offsets[k + 1]`. The moves made by the last call
+ * to `sort_by_label` are recorded in `gather`, `source` and `swaps`, see
+ * `permute_rows` and `permute_cols`.
+ */
+struct label_permutation {
+    tracked_vector<int, MEMORY_LABELS> order;
+    tracked_vector<int, MEMORY_LABELS> position;
+    tracked_vector<label_type, MEMORY_LABELS> labels;
+    tracked_vector<int, MEMORY_LABELS> offsets;
+    bool gather = false;
+    tracked_vector<int, MEMORY_BUFFERS> source;
+    tracked_vector<std::pair<int, int>, MEMORY_BUFFERS> swaps;
+};
+
+static const int sorted_block_cols = 64;
+
+/**
+ * A matrix of `num_rows` by `num_cols` elements whose rows and columns are
+ * permuted as given by `rows` and `cols`. `buffer` holds one row, and
+ * `block_sum` and `label_norm` the sums of the label updates, see
+ * `update_sorted_row_labels` and `update_sorted_col_labels`.
+ */
+template<typename T>
+struct sorted_matrix {
+    int num_rows = 0;
+    int num_cols = 0;
+    T* matrix = nullptr;
+    label_permutation rows;
+    label_permutation cols;
+    tracked_vector<T, MEMORY_BUFFERS> buffer;
+    tracked_vector<double, MEMORY_DISTANCES> block_sum;
+    tracked_vector<double, MEMORY_CLUSTERS> label_norm;
+};
+
+static inline void swap_positions(label_permutation* perm, int p, int q) {
+    if (p == q) {
+        return;
+    }
+
+    std::swap(perm->order[p], perm->order[q]);
+    std::swap(perm->labels[p], perm->labels[q]);
+    perm->position[perm->order[p]] = p;
+    perm->position[perm->order[q]] = q;
+    perm->swaps.emplace_back(p, q);
+}
+
+/**
+ * Sort the items of `perm` by label again after their labels changed. An item
+ * that changed its label is moved to its new block by swapping it across the
+ * boundaries of the blocks in between, which moves few items when few labels
+ * changed. If that would move more items than sorting all of them, or if
+ * `full` is set, the items are sorted with a (stable) counting sort instead.
+ * Returns false if no item had to move.
+ */
+static inline bool sort_by_label(label_permutation* perm, bool full = false) {
+    int num_items = int(perm->order.size());
+    int num_labels = int(perm->offsets.size()) - 1;
+    auto& order = perm->order;
+    auto& position = perm->position;
+    auto& labels = perm->labels;
+    auto& offsets = perm->offsets;
+    int* source = perm->source.data();
+    int num_changed = 0;
+
+    perm->swaps.clear();
+
+    if (!full) {
+        // Find the items that are no longer in the block of their label; each
+        // one costs a swap for every block boundary it crosses
+        double num_swaps = 0;
+
+        for (int k = 0; k < num_labels; k++) {
+            for (int p = offsets[k]; p < offsets[k + 1]; p++) {
+                if (labels[p] != k) {
+                    source[num_changed++] = order[p];
+                    num_swaps += std::abs(labels[p] - k);
+                }
+            }
+        }
+
+        if (num_changed == 0) {
+            perm->gather = false;
+            return false;
+        }
+
+        // A swap moves two items, sorting moves all of them
+        full = 2 * num_swaps > num_items;
+    }
+
+    perm->gather = full;
+
+    if (!full) {
+        for (int n = 0; n < num_changed; n++) {
+            int p = position[source[n]];
+            int from = int(std::upper_bound(offsets.begin(), offsets.end(), p) - offsets.begin()) - 1;
+            int to = labels[p];
+
+            // Move to the end of the block and over its boundary, which
+            // shifts the item into the next block, until it is in `to`
+            while (from < to) {
+                int last = offsets[from + 1] - 1;
+                swap_positions(perm, p, last);
+                offsets[from + 1]--;
+                p = last;
+                from++;
+            }
+
+            while (from > to) {
+                int first = offsets[from];
+                swap_positions(perm, p, first);
+                offsets[from]++;
+                p = first;
+                from--;
+            }
+        }
+
+        return true;
+    }
+
+    // Counting sort: new position q takes the item at position source[q]
+    std::fill(offsets.begin(), offsets.end(), 0);
+
+    for (int p = 0; p < num_items; p++) {
+        offsets[labels[p] + 1]++;
+    }
+
+    for (int k = 0; k < num_labels; k++) {
+        offsets[k + 1] += offsets[k];
+    }
+
+    for (int p = 0; p < num_items; p++) {
+        source[offsets[labels[p]]++] = p;
+    }
+
+    // offsets[k] is now the end of block k
+    for (int k = num_labels; k > 0; k--) {
+        offsets[k] = offsets[k - 1];
+    }
+
+    offsets[0] = 0;
+
+    for (int q = 0; q < num_items; q++) {
+        position[q] = order[source[q]];
+    }
+
+    std::swap(order, position);
+
+    for (int q = 0; q < num_items; q++) {
+        position[order[q]] = q;
+    }
+
+    for (int k = 0; k < num_labels; k++) {
+        std::fill(labels.begin() + offsets[k], labels.begin() + offsets[k + 1], k);
+    }
+
+    return true;
+}
+
+/**
+ * Move the rows of `matrix` as the items of `rows` were moved by the last
+ * call to `sort_by_label`. `buffer` holds one row. This resets `rows->source`.
+ */
+template<typename T>
+static void permute_rows(
+    int num_rows,
+    int num_cols,
+    T* matrix,
+    label_permutation* rows,
+    T* buffer) {
+    if (!rows->gather) {
+        for (auto [p, q] : rows->swaps) {
+            T* row_p = &matrix[index_type(p) * num_cols];
+            std::swap_ranges(row_p, row_p + num_cols, &matrix[index_type(q) * num_cols]);
+        }
+
+        return;
+    }
+
+    // Follow the cycles of the permutation, marking moved rows as in place
+    int* source = rows->source.data();
+
+    for (int q = 0; q < num_rows; q++) {
+        if (source[q] == q) {
+            continue;
+        }
+
+        T* row_q = &matrix[index_type(q) * num_cols];
+        std::copy(row_q, row_q + num_cols, buffer);
+        int current = q;
+
+        while (source[current] != q) {
+            int next = source[current];
+            T* row_next = &matrix[index_type(next) * num_cols];
+            std::copy(row_next, row_next + num_cols, &matrix[index_type(current) * num_cols]);
+            source[current] = current;
+            current = next;
+        }
+
+        std::copy(buffer, buffer + num_cols, &matrix[index_type(current) * num_cols]);
+        source[current] = current;
+    }
+}
+
+/**
+ * Move the columns of `matrix` as the items of `cols` were moved by the last
+ * call to `sort_by_label`, one row at a time. `buffer` holds one row.
+ */
+template<typename T>
+static void permute_cols(
+    int num_rows,
+    int num_cols,
+    T* matrix,
+    const label_permutation& cols,
+    T* buffer) {
+    const int* source = cols.source.data();
+
+    for (int i = 0; i < num_rows; i++) {
+        T* row = &matrix[index_type(i) * num_cols];
+
+        if (cols.gather) {
+            std::copy(row, row + num_cols, buffer);
+
+            for (int j = 0; j < num_cols; j++) {
+                row[j] = buffer[source[j]];
+            }
+        } else {
+            for (auto [p, q] : cols.swaps) {
+                std::swap(row[p], row[q]);
+            }
+        }
+    }
+}
+
+static inline void init_permutation(
+    int num_items,
+    int num_labels,
+    const label_type* labels,
+    label_permutation* perm) {
+    perm->order.resize(num_items);
+    std::iota(perm->order.begin(), perm->order.end(), 0);
+    perm->position.resize(num_items);
+    perm->labels.assign(labels, labels + num_items);
+    perm->offsets.resize(num_labels + 1);
+    perm->source.resize(num_items);
+    perm->swaps.reserve(num_items / 2 + 1);
+    sort_by_label(perm, true);
+}
+
+/**
+ * Returns the size of the buffers allocated by `init_sorted_matrix` for
+ * elements of type T: per row and column its position, label, source and
+ * (at most half of them) a swap, one row of the matrix, and the sums of the
+ * label updates.
+ */
+template<typename T>
+static double estimate_sorted_workspace_bytes(
+    int num_rows,
+    int num_cols,
+    int num_row_labels,
+    int num_col_labels) {
+    double num_items = double(num_rows) + num_cols;
+    return num_items * (3 * sizeof(int) + sizeof(label_type) + sizeof(std::pair<int, int>) / 2)
+        + double(num_row_labels + num_col_labels + 2) * sizeof(int)
+        + double(num_cols) * sizeof(T)
+        + std::max(double(num_col_labels), double(sorted_block_cols) * num_row_labels) * sizeof(double)
+        + std::max(num_row_labels, num_col_labels) * sizeof(double);
+}
+
+/**
+ * Sort the rows and columns of `matrix` by their labels, in place. The labels
+ * are taken from `row_labels` and `col_labels` but are not modified, see
+ * `restore_labels`.
+ */
+template<typename T>
+static void init_sorted_matrix(
+    int num_rows,
+    int num_cols,
+    int num_row_labels,
+    int num_col_labels,
+    T* matrix,
+    const label_type* row_labels,
+    const label_type* col_labels,
+    sorted_matrix<T>* sorted) {
+    sorted->num_rows = num_rows;
+    sorted->num_cols = num_cols;
+    sorted->matrix = matrix;
+    sorted->buffer.resize(num_cols);
+    sorted->block_sum.resize(std::max(num_col_labels, sorted_block_cols * num_row_labels));
+    sorted->label_norm.resize(std::max(num_row_labels, num_col_labels));
+
+    init_permutation(num_rows, num_row_labels, row_labels, &sorted->rows);
+    init_permutation(num_cols, num_col_labels, col_labels, &sorted->cols);
+    permute_rows(num_rows, num_cols, matrix, &sorted->rows, sorted->buffer.data());
+    permute_cols(num_rows, num_cols, matrix, sorted->cols, sorted->buffer.data());
+}
+
+/**
+ * Sort the rows of `sorted` after their labels were updated.
+ */
+template<typename T>
+static void sort_rows(sorted_matrix<T>* sorted) {
+    TRACE_SCOPE("sort_rows", "thread");
+
+    if (sort_by_label(&sorted->rows)) {
+        permute_rows(
+            sorted->num_rows,
+            sorted->num_cols,
+            sorted->matrix,
+            &sorted->rows,
+            sorted->buffer.data());
+    }
+}
+
+/**
+ * Sort the columns of `sorted` after their labels were updated.
+ */
+template<typename T>
+static void sort_cols(sorted_matrix<T>* sorted) {
+    TRACE_SCOPE("sort_cols", "thread");
+
+    if (sort_by_label(&sorted->cols)) {
+        permute_cols(
+            sorted->num_rows,
+            sorted->num_cols,
+            sorted->matrix,
+            sorted->cols,
+            sorted->buffer.data());
+    }
+}
+
+/**
+ * Store the labels of `sorted` in the original order of the rows and columns.
+ */
+template<typename T>
+static void restore_labels(
+    const sorted_matrix<T>& sorted,
+    label_type* row_labels,
+    label_type* col_labels) {
+    for (int p = 0; p < sorted.num_rows; p++) {
+        row_labels[sorted.rows.order[p]] = sorted.rows.labels[p];
+    }
+
+    for (int p = 0; p < sorted.num_cols; p++) {
+        col_labels[sorted.cols.order[p]] = sorted.cols.labels[p];
+    }
+}
+
+/**
+ * Like `calculate_cluster_average`, but every cluster is summed as a block.
+ * The cluster sizes follow from the block sizes.
+ */
+template<typename T>
+static void calculate_sorted_cluster_average(
+    int num_row_labels,
+    int num_col_labels,
+    const sorted_matrix<T>& sorted,
+    serial_workspace<T>* workspace) {
+    using C = typename compute_type<T>::type;
+    const int* row_offsets = sorted.rows.offsets.data();
+    const int* col_offsets = sorted.cols.offsets.data();
+    auto& cluster_sum = workspace->cluster_sum;
+    auto& cluster_size = workspace->cluster_size;
+    auto& cluster_avg = workspace->cluster_avg;
+
+    std::fill(cluster_sum.begin(), cluster_sum.end(), 0.0);
+
+    for (int r = 0; r < num_row_labels; r++) {
+        for (int i = row_offsets[r]; i < row_offsets[r + 1]; i++) {
+            const T* row = &sorted.matrix[index_type(i) * sorted.num_cols];
+
+            for (int c = 0; c < num_col_labels; c++) {
+                double sum = 0;
+
+                for (int j = col_offsets[c]; j < col_offsets[c + 1]; j++) {
+                    sum += C(row[j]);
+                }
+
+                cluster_sum[r * num_col_labels + c] += sum;
+            }
+        }
+    }
+
+    for (int r = 0; r < num_row_labels; r++) {
+        for (int c = 0; c < num_col_labels; c++) {
+            auto index = r * num_col_labels + c;
+            cluster_size[index] = index_type(row_offsets[r + 1] - row_offsets[r])
+                * (col_offsets[c + 1] - col_offsets[c]);
+            cluster_avg[index] = C(cluster_sum[index]) / C(cluster_size[index]);
+        }
+    }
+}
+
+/**
+ * Like `update_row_labels`, but the column labels are constant within every
+ * block of columns: every row is summed per block, and its distances to all
+ * row labels follow from these sums. The labels are updated in
+ * `sorted->rows.labels`, but the rows are not moved, see `sort_rows`.
+ */
+template<typename T>
+static std::pair<int, double> update_sorted_row_labels(
+    int num_row_labels,
+    int num_col_labels,
+    sorted_matrix<T>* sorted,
+    const typename compute_type<T>::type* cluster_avg) {
+    using C = typename compute_type<T>::type;
+    const int* col_offsets = sorted->cols.offsets.data();
+    label_type* row_labels = sorted->rows.labels.data();
+    double* block_sum = sorted->block_sum.data();
+    double* avg_norm = sorted->label_norm.data();
+    int num_updated = 0;
+    double total_dist = 0;
+
+    // The term n a^2 of every row label. Column labels without columns are
+    // skipped, since their averages are not defined.
+    for (int k = 0; k < num_row_labels; k++) {
+        avg_norm[k] = 0;
+
+        for (int c = 0; c < num_col_labels; c++) {
+            if (col_offsets[c + 1] > col_offsets[c]) {
+                double y = cluster_avg[k * num_col_labels + c];
+                avg_norm[k] += double(col_offsets[c + 1] - col_offsets[c]) * y * y;
+            }
+        }
+    }
+
+    for (int i = 0; i < sorted->num_rows; i++) {
+        const T* row = &sorted->matrix[index_type(i) * sorted->num_cols];
+        double row_norm = 0;
+
+        for (int c = 0; c < num_col_labels; c++) {
+            double sum = 0;
+
+            for (int j = col_offsets[c]; j < col_offsets[c + 1]; j++) {
+                C item = row[j];
+                sum += item;
+                row_norm += double(item) * item;
+            }
+
+            block_sum[c] = sum;
+        }
+
+        int best_label = -1;
+        double best_dist = INFINITY;
+
+        for (int k = 0; k < num_row_labels; k++) {
+            double dot = 0;
+
+            for (int c = 0; c < num_col_labels; c++) {
+                if (col_offsets[c + 1] > col_offsets[c]) {
+                    dot += double(cluster_avg[k * num_col_labels + c]) * block_sum[c];
+                }
+            }
+
+            double dist = row_norm - 2 * dot + avg_norm[k];
+
+            if (dist < best_dist) {
+                best_dist = dist;
+                best_label = k;
+            }
+        }
+
+        if (row_labels[i] != best_label) {
+            row_labels[i] = best_label;
+            num_updated++;
+        }
+
+        total_dist += best_dist;
+    }
+
+    return {num_updated, total_dist};
+}
+
+/**
+ * Like `update_col_labels`, but the row labels are constant within every
+ * block of rows. The matrix is streamed by row in blocks of
+ * `sorted_block_cols` columns, which are summed per block of rows; the
+ * distances of the columns to all column labels follow from these sums. The
+ * labels are updated in `sorted->cols.labels`, but the columns are not moved,
+ * see `sort_cols`.
+ */
+template<typename T>
+static std::pair<int, double> update_sorted_col_labels(
+    int num_row_labels,
+    int num_col_labels,
+    sorted_matrix<T>* sorted,
+    const typename compute_type<T>::type* cluster_avg) {
+    using C = typename compute_type<T>::type;
+    const int block_cols = sorted_block_cols;
+    const int* row_offsets = sorted->rows.offsets.data();
+    label_type* col_labels = sorted->cols.labels.data();
+    double* block_sum = sorted->block_sum.data();
+    double* avg_norm = sorted->label_norm.data();
+    double col_norm[block_cols];
+    double dot[block_cols];
+    double best_dist[block_cols];
+    int best_label[block_cols];
+    int num_updated = 0;
+    double total_dist = 0;
+
+    // The term n a^2 of every column label, skipping empty row labels
+    for (int k = 0; k < num_col_labels; k++) {
+        avg_norm[k] = 0;
+
+        for (int r = 0; r < num_row_labels; r++) {
+            if (row_offsets[r + 1] > row_offsets[r]) {
+                double y = cluster_avg[r * num_col_labels + k];
+                avg_norm[k] += double(row_offsets[r + 1] - row_offsets[r]) * y * y;
+            }
+        }
+    }
+
+    for (int col_begin = 0; col_begin < sorted->num_cols; col_begin += block_cols) {
+        int num_block_cols = std::min(block_cols, sorted->num_cols - col_begin);
+
+        // block_sum[r, j] is the sum of column col_begin + j over the rows
+        // with label r
+        std::fill(block_sum, block_sum + num_row_labels * block_cols, 0.0);
+        std::fill(col_norm, col_norm + num_block_cols, 0.0);
+
+        for (int r = 0; r < num_row_labels; r++) {
+            double* sum = &block_sum[r * block_cols];
+
+            for (int i = row_offsets[r]; i < row_offsets[r + 1]; i++) {
+                const T* row = &sorted->matrix[index_type(i) * sorted->num_cols + col_begin];
+
+                for (int j = 0; j < num_block_cols; j++) {
+                    C item = row[j];
+                    sum[j] += item;
+                    col_norm[j] += double(item) * item;
+                }
+            }
+        }
+
+        std::fill(best_dist, best_dist + num_block_cols, INFINITY);
+        std::fill(best_label, best_label + num_block_cols, -1);
+
+        for (int k = 0; k < num_col_labels; k++) {
+            std::fill(dot, dot + num_block_cols, 0.0);
+
+            for (int r = 0; r < num_row_labels; r++) {
+                if (row_offsets[r + 1] == row_offsets[r]) {
+                    continue;
+                }
+
+                double y = cluster_avg[r * num_col_labels + k];
+                const double* sum = &block_sum[r * block_cols];
+
+                for (int j = 0; j < num_block_cols; j++) {
+                    dot[j] += y * sum[j];
+                }
+            }
+
+            for (int j = 0; j < num_block_cols; j++) {
+                double dist = col_norm[j] - 2 * dot[j] + avg_norm[k];
+
+                if (dist < best_dist[j]) {
+                    best_dist[j] = dist;
+                    best_label[j] = k;
+                }
+            }
+        }
+
+        for (int j = 0; j < num_block_cols; j++) {
+            if (col_labels[col_begin + j] != best_label[j]) {
+                col_labels[col_begin + j] = best_label[j];
+                num_updated++;
+            }
+
+            total_dist += best_dist[j];
+        }
+    }
+
+    return {num_updated, total_dist};
+}
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <chrono>
+#include <iostream>
+
+#include "perf_counters.h"
+#include "trace.h"
+
+/**
+ * The phases of one iteration of the co-clustering algorithm. Each
+ * implementation calls `set_phase` when it moves on to the next phase, and
+ * the wall-clock time spent in each phase is accumulated in `phase_seconds`.
+ * If tracing is enabled, every phase also appears on the timeline, and if
+ * hardware counters are enabled, they are accumulated per phase as well.
+ */
+enum algorithm_phase {
+    PHASE_CLUSTER_AVERAGE,
+    PHASE_ROW_UPDATE,
+    PHASE_COL_UPDATE,
+    PHASE_OTHER,
+    NUM_PHASES
+};
+
+static const char* phase_names[NUM_PHASES] = {
+    "calculate_cluster_average",
+    "update_row_labels",
+    "update_col_labels",
+    "other",
+};
+
+static int current_phase = PHASE_OTHER;
+static double phase_seconds[NUM_PHASES];
+static auto phase_start = std::chrono::high_resolution_clock::now();
+static double trace_phase_start = 0;
+
+/**
+ * Time spent in communication and in file I/O. These overlap with the phases
+ * above, since they are counted in the phase in which they occur as well.
+ * Communication is measured by the MPI wrappers in mpi_profile.h and I/O by
+ * the callers of the I/O functions.
+ */
+static double communication_seconds = 0;
+static double io_seconds = 0;
+
+static double phase_counters[NUM_PHASES][NUM_PERF_COUNTERS];
+static double phase_counters_start[NUM_PERF_COUNTERS];
+
+/**
+ * Start counting hardware events per phase (see perf_counters.h). Returns
+ * false if no counter is available.
+ */
+static inline bool enable_phase_counters() {
+    if (!perf_counters_open()) {
+        return false;
+    }
+
+    perf_counters_read(phase_counters_start);
+    return true;
+}
+
+/**
+ * Switch to phase `phase`. The time since the previous call is added to the
+ * previous phase.
+ */
+static inline void set_phase(algorithm_phase phase) {
+    auto now = std::chrono::high_resolution_clock::now();
+    phase_seconds[current_phase] +=
+        std::chrono::duration<double>(now - phase_start).count();
+    phase_start = now;
+
+    if (perf_counters_enabled) {
+        double counters[NUM_PERF_COUNTERS];
+        perf_counters_read(counters);
+
+        for (int i = 0; i < NUM_PERF_COUNTERS; i++) {
+            phase_counters[current_phase][i] += counters[i] - phase_counters_start[i];
+            phase_counters_start[i] = counters[i];
+        }
+    }
+
+    if (trace_enabled && phase != current_phase) {
+        double trace_end = trace_now();
+        trace_record(
+            phase_names[current_phase],
+            "phase",
+            trace_phase_start,
+            trace_end - trace_phase_start);
+        trace_phase_start = trace_end;
+    }
+
+    current_phase = phase;
+}
+
+static inline void print_phase_times() {
+    set_phase(algorithm_phase(current_phase));
+
+    for (int i = 0; i < NUM_PHASES; i++) {
+        std::cout << "time in " << phase_names[i] << ": " << phase_seconds[i]
+                  << " seconds\n";
+    }
+}
+
+/**
+ * Print the hardware counters of each phase and the metrics derived from
+ * them. `counters` holds the counts per phase (e.g., `phase_counters`, or its
+ * sum over all ranks) and `num_elements` is the number of matrix elements
+ * processed by each phase, i.e., the size of the matrix times the number of
+ * iterations. The memory traffic is estimated as one 64-byte cache line per
+ * LLC miss, since uncore bandwidth counters are not accessible per process.
+ */
+static inline void print_phase_counters(
+    const double counters[NUM_PHASES][NUM_PERF_COUNTERS],
+    double num_elements) {
+    if (!perf_counters_enabled) {
+        return;
+    }
+
+    set_phase(algorithm_phase(current_phase));
+
+    for (int i = 0; i < NUM_PHASES; i++) {
+        const double* c = counters[i];
+        double bytes = c[PERF_LLC_MISSES] * 64;
+
+        std::cout << "counters in " << phase_names[i] << ": cycles "
+                  << c[PERF_CYCLES] << ", instructions " << c[PERF_INSTRUCTIONS]
+                  << ", IPC " << (c[PERF_INSTRUCTIONS] / c[PERF_CYCLES])
+                  << ", LLC misses " << c[PERF_LLC_MISSES] << ", dTLB misses "
+                  << c[PERF_DTLB_MISSES] << ", dTLB misses/element "
+                  << (c[PERF_DTLB_MISSES] / num_elements) << ", bytes/element "
+                  << (bytes / num_elements) << ", bandwidth "
+                  << (bytes / phase_seconds[i] / 1e9) << " GB/s\n";
+    }
+}
@@ -0,0 +1,183 @@
+#pragma once
+
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+ * Timeline tracing in the Chrome trace-event format, which can be viewed in
+ * chrome://tracing or https://ui.perfetto.dev. Tracing is enabled with
+ * `--trace FILE`. Code is instrumented with `TRACE_SCOPE(name, category)`,
+ * which records the time until the end of the enclosing scope; the phases of
+ * timing.h and the MPI calls of mpi_profile.h are traced automatically.
+ *
+ * Every thread appends to its own buffer, so recording takes no locks. When
+ * tracing is disabled, a scope only tests `trace_enabled`; building with
+ * -DCGC_NO_TRACE removes the scopes altogether.
+ */
+struct trace_event {
+    const char* name;
+    const char* category;
+    double start;
+    double duration;
+};
+
+struct trace_buffer {
+    int thread;
+    std::vector<trace_event> events;
+};
+
+static bool trace_enabled = false;
+static auto trace_epoch = std::chrono::high_resolution_clock::now();
+static std::mutex trace_mutex;
+static std::vector<std::unique_ptr<trace_buffer>> trace_buffers;
+
+/**
+ * Enable tracing. Timestamps are relative to `epoch`, which defaults to the
+ * time of this call, so ranks that call it right after a barrier share a
+ * common clock.
+ */
+static inline void trace_enable(
+    std::chrono::high_resolution_clock::time_point epoch =
+        std::chrono::high_resolution_clock::now()) {
+    trace_enabled = true;
+    trace_epoch = epoch;
+}
+
+static inline double trace_now() {
+    auto now = std::chrono::high_resolution_clock::now();
+    return std::chrono::duration<double>(now - trace_epoch).count();
+}
+
+static inline trace_buffer* trace_thread_buffer() {
+    thread_local trace_buffer* buffer = nullptr;
+
+    if (buffer == nullptr) {
+        std::lock_guard<std::mutex> lock(trace_mutex);
+        trace_buffers.push_back(std::make_unique<trace_buffer>());
+        buffer = trace_buffers.back().get();
+        buffer->thread = int(trace_buffers.size()) - 1;
+    }
+
+    return buffer;
+}
+
+/**
+ * Record an event of `duration` seconds that started at `start` (see
+ * `trace_now`). The name and category must be string literals, since only
+ * the pointers are stored.
+ */
+static inline void trace_record(
+    const char* name,
+    const char* category,
+    double start,
+    double duration) {
+    if (trace_enabled) {
+        trace_thread_buffer()->events.push_back({name, category, start, duration});
+    }
+}
+
+class trace_scope {
+  public:
+    trace_scope(const char* name, const char* category) {
+        if (trace_enabled) {
+            name_ = name;
+            category_ = category;
+            start_ = trace_now();
+        }
+    }
+
+    ~trace_scope() {
+        if (name_ != nullptr) {
+            trace_record(name_, category_, start_, trace_now() - start_);
+        }
+    }
+
+    trace_scope(const trace_scope&) = delete;
+    trace_scope& operator=(const trace_scope&) = delete;
+
+  private:
+    const char* name_ = nullptr;
+    const char* category_ = nullptr;
+    double start_ = 0;
+};
+
+#ifdef CGC_NO_TRACE
+#define TRACE_SCOPE(name, category)
+#else
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(name, category) \
+    trace_scope TRACE_CONCAT(trace_scope_, __LINE__)(name, category)
+#endif
+
+/**
+ * Returns the events of all threads of this process as comma-separated JSON
+ * objects, using `process` as process id. Must not be called while other
+ * threads are recording.
+ */
+static inline std::string trace_serialize(int process) {
+    std::string result;
+    char line[512];
+
+    snprintf(
+        line,
+        sizeof(line),
+        "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, \"args\": {\"name\": \"rank %d\"}}",
+        process,
+        process);
+    result += line;
+
+    for (const auto& buffer : trace_buffers) {
+        snprintf(
+            line,
+            sizeof(line),
+            ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %d, \"args\": {\"name\": \"thread %d\"}}",
+            process,
+            buffer->thread,
+            buffer->thread);
+        result += line;
+
+        for (const auto& event : buffer->events) {
+            snprintf(
+                line,
+                sizeof(line),
+                ",\n{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": %d, \"tid\": %d}",
+                event.name,
+                event.category,
+                event.start * 1e6,
+                event.duration * 1e6,
+                process,
+                buffer->thread);
+            result += line;
+        }
+    }
+
+    return result;
+}
+
+/**
+ * Write the trace file `file_name` containing `events`, the concatenated
+ * output of `trace_serialize` of all processes.
+ */
+static inline bool trace_write(const std::string& file_name, const std::string& events) {
+    FILE* file = fopen(file_name.c_str(), "w");
+
+    if (file == nullptr) {
+        fprintf(stderr, "error: could not open: %s\n", file_name.c_str());
+        return false;
+    }
+
+    fprintf(stderr, "writing trace to %s\n", file_name.c_str());
+    fprintf(file, "{\"traceEvents\": [\n%s\n], \"displayTimeUnit\": \"ms\"}\n", events.c_str());
+
+    if (fclose(file) != 0) {
+        fprintf(stderr, "error: error occurred while writing file: %s\n", file_name.c_str());
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,552 @@
+"""Strong and weak scaling benchmarks for the co-clustering implementations.
+
+The benchmark is described by a JSON configuration file (see benchmark.json).
+For every input matrix and every configuration of ranks and threads, the
+selected backends are run and their output is parsed for the number of
+iterations, the clustering time and the time per phase. The results are
+written as CSV and JSON.
+
+The same configuration file can be used on a development machine (with
+`mpirun --oversubscribe`) and on a cluster by overriding the launcher, e.g.
+`--set mpirun="srun -n {ranks}"`.
+
+With `--save-baseline`, the results and output labels are stored in
+`baseline_dir`, keyed by machine fingerprint and git commit. With `--compare`,
+a run is compared against a stored baseline of the same machine: the exit code
+is nonzero if a run is more than `max_slowdown` slower per iteration, or if
+its labels differ from the baseline and their NMI is below `min_nmi`.
+"""
+import argparse
+import csv
+import datetime
+import filecmp
+import hashlib
+import json
+import os
+import platform
+import random
+import re
+import shlex
+import shutil
+import struct
+import subprocess
+import sys
+
+DEFAULT_CONFIG = {
+    "bin_dir": ".",
+    "data_dir": "bench_data",
+    "mpirun": "mpirun --oversubscribe -np {ranks}",
+    "labels": "5x20",
+    "max_iterations": 10,
+    "repetitions": 1,
+    "seed": 1,
+    "backends": ["serial", "mpi"],
+    "ranks": [1, 2, 4],
+    "threads": [1],
+    "inputs": [],
+    "strong_scaling": {"shapes": []},
+    "weak_scaling": {"shape_per_rank": None, "scale_axis": "cols"},
+    "baseline_dir": "bench_baselines",
+    "max_slowdown": 0.1,
+    "min_nmi": 0.999,
+}
+
+BINARIES = {
+    "serial": "cgc_serial",
+    "mpi": "cgc_mpi",
+    "cuda": "cgc_cuda",
+}
+
+
+def parse_arguments():
+    parser = argparse.ArgumentParser(prog="benchmark coclustering")
+    parser.add_argument("config", help="JSON file describing the benchmark")
+    parser.add_argument(
+        "--output",
+        default="bench_results",
+        help="Prefix of the CSV and JSON result files",
+    )
+    parser.add_argument(
+        "--set",
+        action="append",
+        default=[],
+        metavar="KEY=VALUE",
+        help="Override a configuration entry (VALUE is parsed as JSON if possible)",
+    )
+    parser.add_argument(
+        "--save-baseline",
+        action="store_true",
+        help="Store the results as the baseline of the current commit",
+    )
+    parser.add_argument(
+        "--compare",
+        nargs="?",
+        const="latest",
+        metavar="COMMIT",
+        help="Compare the results against the baseline of COMMIT (default: latest)",
+    )
+    return parser.parse_args()
+
+
+def load_config(filename, overrides):
+    config = dict(DEFAULT_CONFIG)
+
+    with open(filename) as f:
+        config.update(json.load(f))
+
+    for override in overrides:
+        key, value = override.split("=", 1)
+
+        try:
+            config[key] = json.loads(value)
+        except json.JSONDecodeError:
+            config[key] = value
+
+    return config
+
+
+def write_npy_header(f, shape):
+    header = "{'descr': '<f4', 'fortran_order': False, 'shape': (%d, %d), }" % shape
+    header += " " * ((16 - (10 + len(header) + 1) % 16) % 16) + "\n"
+    f.write(b"\x93NUMPY\x01\x00")
+    f.write(struct.pack("<H", len(header)))
+    f.write(header.encode("latin1"))
+
+
+def generate_matrix(filename, rows, cols, seed):
+    """Write a float32 NPY file of the given shape with a planted block
+    structure plus Gaussian noise. This is only used if `cgc_gen` has not
+    been built, since it is slow for large matrices."""
+    print(f"generating {filename} ({rows} x {cols})...", file=sys.stderr)
+    rng = random.Random(seed)
+    row_means = [rng.uniform(-5, 5) for _ in range(8)]
+    col_means = [rng.uniform(-5, 5) for _ in range(8)]
+    col_labels = [rng.randrange(8) for _ in range(cols)]
+
+    with open(filename, "wb") as f:
+        write_npy_header(f, (rows, cols))
+
+        for i in range(rows):
+            base = row_means[rng.randrange(8)]
+            row = [base * col_means[c] + rng.gauss(0, 1) for c in col_labels]
+            f.write(struct.pack("<%df" % cols, *row))
+
+
+def matrix_file(config, rows, cols):
+    os.makedirs(config["data_dir"], exist_ok=True)
+    filename = os.path.join(config["data_dir"], f"matrix_{rows}x{cols}.npy")
+
+    if os.path.exists(filename):
+        return filename
+
+    generator = os.path.join(config["bin_dir"], "cgc_gen")
+
+    if os.path.exists(generator):
+        command = [generator, filename, "--rows", str(rows), "--cols", str(cols)]
+        subprocess.run(command + ["--seed", str(config["seed"])], check=True)
+    else:
+        generate_matrix(filename, rows, cols, config["seed"])
+
+    return filename
+
+
+def parse_output(text):
+    """Extract the iterations and timings from the output of a backend."""
+    result = {"iterations": 0, "phases": {}}
+
+    for line in text.splitlines():
+        m = re.match(r"iteration (\d+):", line)
+        if m:
+            result["iterations"] = int(m.group(1))
+
+        m = re.match(r"clustering time total: ([0-9.e+-]+) seconds", line)
+        if m:
+            result["clustering_seconds"] = float(m.group(1))
+
+        m = re.match(r"total execution time: ([0-9.e+-]+) seconds", line)
+        if m:
+            result["total_seconds"] = float(m.group(1))
+
+        m = re.match(r"time in (\w+): ([0-9.e+-]+) seconds", line)
+        if m:
+            result["phases"][m.group(1)] = float(m.group(2))
+
+    return result
+
+
+def run_backend(config, backend, filename, shape, ranks, threads):
+    binary = os.path.join(config["bin_dir"], BINARIES[backend])
+    rows, cols = shape
+    labels_file = f"labels_{backend}_{rows}x{cols}_{ranks}x{threads}.txt"
+    output = os.path.join(config["data_dir"], labels_file)
+    command = [
+        binary,
+        filename,
+        config["labels"],
+        "--max-iterations",
+        str(config["max_iterations"]),
+        "--seed",
+        str(config["seed"]),
+        "--output",
+        output,
+    ]
+
+    if backend != "serial":
+        command = shlex.split(config["mpirun"].format(ranks=ranks)) + command
+
+    env = dict(os.environ, OMP_NUM_THREADS=str(threads))
+    best = None
+
+    for _ in range(config["repetitions"]):
+        proc = subprocess.run(
+            command, env=env, stdout=subprocess.PIPE, stderr=subprocess.PIPE, text=True
+        )
+
+        if proc.returncode != 0:
+            print(f"error: {' '.join(command)} failed:", file=sys.stderr)
+            print(proc.stderr, file=sys.stderr)
+            return None
+
+        result = parse_output(proc.stdout)
+
+        if best is None or result["clustering_seconds"] < best["clustering_seconds"]:
+            best = result
+
+    best.update(
+        {
+            "backend": backend,
+            "input": filename,
+            "rows": rows,
+            "cols": cols,
+            "labels": config["labels"],
+            "ranks": ranks,
+            "threads": threads,
+            "labels_file": output,
+        }
+    )
+    best["seconds_per_iteration"] = best["clustering_seconds"] / max(
+        best["iterations"], 1
+    )
+    best["elements_per_second"] = (
+        rows * cols * best["iterations"] / best["clustering_seconds"]
+    )
+    return best
+
+
+def configurations(config, backend):
+    """The (ranks, threads) pairs to run for a backend."""
+    if backend == "serial":
+        return [(1, 1)]
+
+    threads = config["threads"] if backend == "mpi" else [1]
+    return [(r, t) for r in config["ranks"] for t in threads]
+
+
+def run_strong_scaling(config):
+    inputs = [(entry["path"], None) for entry in config["inputs"]]
+    inputs += [
+        (matrix_file(config, rows, cols), (rows, cols))
+        for rows, cols in config["strong_scaling"]["shapes"]
+    ]
+    results = []
+
+    for filename, shape in inputs:
+        if shape is None:
+            shape = read_npy_shape(filename)
+
+        for backend in config["backends"]:
+            for ranks, threads in configurations(config, backend):
+                result = run_backend(config, backend, filename, shape, ranks, threads)
+
+                if result is not None:
+                    result["scaling"] = "strong"
+                    results.append(result)
+
+    # Speedup and efficiency relative to the run with the fewest workers
+    for filename, _ in inputs:
+        runs = [r for r in results if r["input"] == filename]
+        if not runs:
+            continue
+
+        base = min(runs, key=lambda r: (r["ranks"] * r["threads"], r["backend"] != "serial"))
+
+        for r in runs:
+            workers = r["ranks"] * r["threads"]
+            r["speedup"] = base["seconds_per_iteration"] / r["seconds_per_iteration"]
+            r["efficiency"] = r["speedup"] / workers
+
+    return results
+
+
+def run_weak_scaling(config):
+    shape_per_rank = config["weak_scaling"]["shape_per_rank"]
+    if not shape_per_rank:
+        return []
+
+    axis = config["weak_scaling"]["scale_axis"]
+    results = []
+
+    for backend in config["backends"]:
+        base = None
+
+        for ranks, threads in configurations(config, backend):
+            workers = ranks * threads
+            rows, cols = shape_per_rank
+            shape = (rows * workers, cols) if axis == "rows" else (rows, cols * workers)
+            filename = matrix_file(config, *shape)
+            result = run_backend(config, backend, filename, shape, ranks, threads)
+
+            if result is None:
+                continue
+
+            if base is None:
+                base = result
+
+            result["scaling"] = "weak"
+            result["efficiency"] = (
+                base["seconds_per_iteration"] / result["seconds_per_iteration"]
+            )
+            results.append(result)
+
+    return results
+
+
+def read_npy_shape(filename):
+    with open(filename, "rb") as f:
+        header = f.read(256).decode("latin1")
+
+    m = re.search(r"'shape': \((\d+), (\d+)\)", header)
+    return int(m.group(1)), int(m.group(2))
+
+
+def write_results(results, prefix):
+    with open(prefix + ".json", "w") as f:
+        json.dump(results, f, indent=2)
+
+    phases = sorted({p for r in results for p in r["phases"]})
+    columns = [
+        "scaling",
+        "backend",
+        "input",
+        "rows",
+        "cols",
+        "labels",
+        "ranks",
+        "threads",
+        "iterations",
+        "clustering_seconds",
+        "seconds_per_iteration",
+        "elements_per_second",
+        "speedup",
+        "efficiency",
+    ]
+
+    with open(prefix + ".csv", "w", newline="") as f:
+        writer = csv.writer(f)
+        writer.writerow(columns + ["time_" + p for p in phases])
+
+        for r in results:
+            writer.writerow(
+                [r.get(c, "") for c in columns]
+                + [r["phases"].get(p, "") for p in phases]
+            )
+
+    print(f"results written to {prefix}.csv and {prefix}.json")
+
+
+def git_commit():
+    """The commit of the working tree, with a "-dirty" suffix if tracked files
+    have been modified."""
+    root = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+    def git(*args):
+        return subprocess.run(
+            ["git", "-C", root, *args], stdout=subprocess.PIPE, text=True
+        ).stdout.strip()
+
+    commit = git("rev-parse", "--short", "HEAD") or "unknown"
+
+    if git("status", "--porcelain", "--untracked-files=no"):
+        commit += "-dirty"
+
+    return commit
+
+
+def machine_info():
+    """Describes the machine, so baselines are only compared against runs on
+    the same kind of hardware."""
+    cpu = platform.processor()
+
+    try:
+        with open("/proc/cpuinfo") as f:
+            for line in f:
+                if line.startswith("model name"):
+                    cpu = line.split(":", 1)[1].strip()
+                    break
+    except OSError:
+        pass
+
+    info = {
+        "hostname": platform.node(),
+        "system": platform.system(),
+        "machine": platform.machine(),
+        "cpu": cpu,
+        "cpus": os.cpu_count(),
+    }
+    info["fingerprint"] = hashlib.sha1(
+        json.dumps(info, sort_keys=True).encode()
+    ).hexdigest()[:12]
+    return info
+
+
+def run_key(result):
+    return "/".join(
+        str(result[k])
+        for k in ["scaling", "backend", "rows", "cols", "labels", "ranks", "threads"]
+    )
+
+
+def save_baseline(results, config, commit, machine):
+    directory = os.path.join(config["baseline_dir"], machine["fingerprint"], commit)
+    os.makedirs(directory, exist_ok=True)
+    results = [dict(r) for r in results]
+
+    for r in results:
+        labels_file = os.path.basename(r["labels_file"])
+        shutil.copyfile(r["labels_file"], os.path.join(directory, labels_file))
+        r["labels_file"] = labels_file
+
+    baseline = {
+        "commit": commit,
+        "machine": machine,
+        "timestamp": datetime.datetime.now().isoformat(),
+        "config": config,
+        "results": results,
+    }
+
+    with open(os.path.join(directory, "results.json"), "w") as f:
+        json.dump(baseline, f, indent=2)
+
+    print(f"baseline written to {directory}")
+
+
+def load_baseline(config, commit, machine):
+    """Returns the directory and contents of the baseline of `commit` (or the
+    most recent one if `commit` is "latest") on this machine, or None."""
+    machine_dir = os.path.join(config["baseline_dir"], machine["fingerprint"])
+    baselines = []
+
+    if os.path.isdir(machine_dir):
+        for name in os.listdir(machine_dir):
+            filename = os.path.join(machine_dir, name, "results.json")
+
+            if os.path.exists(filename) and commit in ("latest", name):
+                with open(filename) as f:
+                    baselines.append((os.path.dirname(filename), json.load(f)))
+
+    if not baselines:
+        return None
+
+    return max(baselines, key=lambda b: b[1]["timestamp"])
+
+
+def labels_match(output, reference, min_nmi):
+    """Returns whether the labels in `output` are identical to `reference`,
+    or else have an NMI of at least `min_nmi`, and a description."""
+    if filecmp.cmp(output, reference, shallow=False):
+        return True, "identical"
+
+    from compare import compare_label_files
+
+    try:
+        nmi = compare_label_files(output, reference)
+    except ValueError as e:
+        return False, str(e)
+
+    return nmi >= min_nmi, f"NMI {nmi:.5f}"
+
+
+def compare_baseline(results, baseline_dir, baseline, config):
+    """Compare `results` to a stored baseline. Returns the number of
+    regressions."""
+    base_runs = {run_key(r): r for r in baseline["results"]}
+    regressions = 0
+
+    print(f"comparing against baseline {baseline['commit']} ({baseline['timestamp']})")
+
+    for r in results:
+        key = run_key(r)
+        base = base_runs.get(key)
+
+        if base is None:
+            print(f"  {key}: no baseline")
+            continue
+
+        change = r["seconds_per_iteration"] / base["seconds_per_iteration"] - 1
+        slow = change > config["max_slowdown"]
+        same, description = labels_match(
+            r["labels_file"],
+            os.path.join(baseline_dir, base["labels_file"]),
+            config["min_nmi"],
+        )
+        status = "ok"
+
+        if slow or not same:
+            status = "REGRESSION"
+            regressions += 1
+
+        print(
+            f"  {key}: {change * 100:+.1f}% time per iteration, "
+            f"labels {description}: {status}"
+        )
+
+    return regressions
+
+
+def main():
+    args = parse_arguments()
+    config = load_config(args.config, args.set)
+
+    commit = git_commit()
+    machine = machine_info()
+    baseline = None
+
+    if args.compare:
+        baseline = load_baseline(config, args.compare, machine)
+
+        if baseline is None:
+            print(
+                f"error: no baseline for {args.compare} on machine "
+                f"{machine['fingerprint']} in {config['baseline_dir']}",
+                file=sys.stderr,
+            )
+            return 1
+
+    results = run_strong_scaling(config) + run_weak_scaling(config)
+
+    for r in results:
+        print(
+            f"{r['scaling']:6} {r['backend']:6} {r['rows']}x{r['cols']} "
+            f"ranks={r['ranks']} threads={r['threads']}: "
+            f"{r['seconds_per_iteration']:.6f} s/iteration, "
+            f"{r['elements_per_second']:.3e} elements/s"
+        )
+
+    write_results(results, args.output)
+    regressions = 0
+
+    if baseline is not None:
+        regressions = compare_baseline(results, *baseline, config)
+
+    if args.save_baseline:
+        save_baseline(results, config, commit, machine)
+
+    if regressions > 0:
+        print(f"error: {regressions} regression(s) found", file=sys.stderr)
+        return 1
+
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -2,6 +2,12 @@ import numpy as np
 
 
 def load_labels(filename):
+    if filename.endswith(".bin"):
+        # Binary: number of rows and columns, followed by the labels as int32
+        values = np.fromfile(filename, dtype=np.int32)
+        num_rows, num_cols = values[0], values[1]
+        return values[2 : 2 + num_rows], values[2 + num_rows : 2 + num_rows + num_cols]
+
     # First line is time labels, second line is location labels
     with open(filename) as f:
         parts = f.read().split("\n\n", 2)
@@ -1,4 +1,5 @@
 import argparse
+import sys
 import numpy as np
 from common import load_labels
 
@@ -15,26 +16,23 @@ def parse_arguments():
     return parser.parse_args()
 
 
-def main():
-    args = parse_arguments()
-
-    print("reading input files...")
-    a_row_labels, a_col_labels = load_labels(args.output)
-    b_row_labels, b_col_labels = load_labels(args.reference)
-
-    # Check if number of labels match
+def normalized_mutual_information(
+    a_row_labels, a_col_labels, b_row_labels, b_col_labels
+):
+    """Returns the NMI between the co-clusterings A and B, where each
+    co-cluster is a combination of a row label and a column label. Raises
+    ValueError if A and B do not have the same number of rows and columns.
+    """
     if (len(a_row_labels), len(a_col_labels)) != (
         len(b_row_labels),
         len(b_col_labels),
     ):
-        print("error: input files have different number of labels")
-        return
+        raise ValueError("input files have different number of labels")
 
     num_row_labels = max(np.amax(a_row_labels), np.amax(b_row_labels)) + 1
     num_col_labels = max(np.amax(a_col_labels), np.amax(b_col_labels)) + 1
 
     # Count the independent clusters in A and B
-    print("calculating NMI...")
     n = len(a_row_labels) * len(a_col_labels)
 
     a_sizes = np.outer(
@@ -68,9 +66,32 @@ def main():
         entropy_a = np.nansum((a_sizes * np.log2(a_sizes / n)))
         entropy_b = np.nansum((b_sizes * np.log2(b_sizes / n)))
 
-    nmi = mutual / np.sqrt(entropy_a * entropy_b)
+    return mutual / np.sqrt(entropy_a * entropy_b)
+
+
+def compare_label_files(output, reference):
+    """Returns the NMI between the labels in the files `output` and
+    `reference`."""
+    a_row_labels, a_col_labels = load_labels(output)
+    b_row_labels, b_col_labels = load_labels(reference)
+    return normalized_mutual_information(
+        a_row_labels, a_col_labels, b_row_labels, b_col_labels
+    )
+
+
+def main():
+    args = parse_arguments()
+
+    print("calculating NMI...")
+    try:
+        nmi = compare_label_files(args.output, args.reference)
+    except ValueError as e:
+        print(f"error: {e}")
+        return 1
+
     print(f"normalized-mutual information: {nmi:.5f}")
+    return 0
 
 
 if __name__ == "__main__":
-    main()
+    sys.exit(main())